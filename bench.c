@@ -0,0 +1,144 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "pfs.h"
+
+// Headless timings of the solver paths on the demo scene, no raylib needed.
+// Usage: bench [particles] [steps]
+
+#define BENCH_BRUTE_FORCE_CAP 2000
+
+typedef enum
+{
+    BENCH_STEPPED,
+    BENCH_EVENTS,
+    BENCH_COMPACT
+} bench_kind_t;
+
+typedef struct
+{
+    const char *name;
+    bench_kind_t kind;
+    PFS_broadphase_t broadphase;
+    PFS_contact_solver_type_t contact_solver;
+} bench_case_t;
+
+
+static double now(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static void bench_state(PFS_state_t *state, bench_case_t *bench)
+{
+    *state = pfs_state_default();
+    state->solver = (bench->kind == BENCH_EVENTS) ? PFS_SOLVER_EVENT_DRIVEN :
+                    (bench->kind == BENCH_COMPACT) ? PFS_SOLVER_COMPACT : PFS_SOLVER_TIME_STEPPED;
+    state->broadphase = bench->broadphase;
+    state->contact_solver = bench->contact_solver;
+}
+
+static double bench_run(bench_case_t *bench, PFS_particle_t *start, size_t particles, int steps, float dt)
+{
+    PFS_state_t state;
+    PFS_t pfs;
+    PFS_compact_t compact = { 0 };
+    double begin;
+    double elapsed;
+
+    bench_state(&state, bench);
+    pfs_create(&pfs, &state, particles);
+    memcpy(pfs.particles_array, start, sizeof(PFS_particle_t) * particles);
+    pfs_add_wall(&pfs, 0.0f, -state.space_width / 4.0f, state.space_width, state.space_width / 2.0f);
+    pfs_add_wall(&pfs, 0.0f, state.space_height - state.space_width / 4.0f, state.space_width, state.space_width / 2.0f);
+
+    if (bench->kind == BENCH_COMPACT)
+    {
+        pfs_compact_create(&compact, particles);
+        pfs_compact_pack(&pfs, &compact);
+    }
+
+    begin = now();
+    for (int n=0; n < steps; n++)
+    {
+        switch (bench->kind)
+        {
+            case BENCH_STEPPED:
+                pfs_handle_collisions_swept(&pfs, dt);
+                for (size_t i=0; i < pfs.particles_size; i++)
+                    pfs_update_particle(&pfs, &pfs.particles_array[i], dt);
+                pfs_handle_collisions(&pfs);
+                break;
+
+            case BENCH_EVENTS:
+                pfs_advance_events(&pfs, dt);
+                break;
+
+            case BENCH_COMPACT:
+                pfs_compact_update(&pfs, &compact, dt);
+                break;
+        }
+    }
+    elapsed = now() - begin;
+
+    if (bench->kind == BENCH_COMPACT)
+        pfs_compact_close(&compact);
+    pfs_close(&pfs);
+
+    return elapsed;
+}
+
+int main(int argc, char **argv)
+{
+    size_t particles = 4000;
+    int steps = 100;
+    const float dt = 1.0f / 240.0f;
+
+    if (argc > 3 || (argc > 1 && sscanf(argv[1], "%zu", &particles) != 1) || (argc > 2 && sscanf(argv[2], "%d", &steps) != 1) ||
+            particles == 0 || steps <= 0)
+    {
+        fprintf(stderr, "ERROR: Usage: %s [particles] [steps]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    bench_case_t benches[] = {
+        { "stepped, brute force, gauss-seidel", BENCH_STEPPED, PFS_BROADPHASE_BRUTE_FORCE, PFS_CONTACT_GAUSS_SEIDEL },
+        { "stepped, grid, gauss-seidel",        BENCH_STEPPED, PFS_BROADPHASE_GRID,        PFS_CONTACT_GAUSS_SEIDEL },
+        { "stepped, grid, jacobi",              BENCH_STEPPED, PFS_BROADPHASE_GRID,        PFS_CONTACT_JACOBI },
+        { "event driven",                       BENCH_EVENTS,  PFS_BROADPHASE_GRID,        PFS_CONTACT_GAUSS_SEIDEL },
+        { "compact",                            BENCH_COMPACT, PFS_BROADPHASE_GRID,        PFS_CONTACT_GAUSS_SEIDEL },
+    };
+
+    // Every case starts from the same particles.
+    PFS_state_t state;
+    PFS_t pfs;
+    bench_state(&state, &benches[0]);
+    pfs_create(&pfs, &state, particles);
+    srand(1);
+    pfs_start_random(&pfs);
+
+    printf("pfs %d.%d.%d, %zu particles, %d steps of %g s\n",
+            PFS_VERSION_MAJOR, PFS_VERSION_MINOR, PFS_VERSION_PATCH, particles, steps, dt);
+    printf("%-36s %10s %12s %14s\n", "case", "total [s]", "step [ms]", "particles/s");
+
+    double elapsed;
+    for (size_t i=0; i < sizeof(benches) / sizeof(benches[0]); i++)
+    {
+        if (benches[i].broadphase == PFS_BROADPHASE_BRUTE_FORCE && particles > BENCH_BRUTE_FORCE_CAP)
+        {
+            printf("%-36s %10s\n", benches[i].name, "skipped");
+            continue;
+        }
+
+        elapsed = bench_run(&benches[i], pfs.particles_array, particles, steps, dt);
+        printf("%-36s %10.3f %12.3f %14.3e\n", benches[i].name, elapsed, 1000.0 * elapsed / steps, particles * steps / elapsed);
+    }
+
+    pfs_close(&pfs);
+
+    return 0;
+}
@@ -1,29 +1,304 @@
 #include <stdio.h>
 #include <raylib.h>
 #include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "pfs.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include "simlib.h"
 
 
-int main(void)
+typedef struct
+{
+    PFS_particle_t *particles;
+    size_t particles_size;
+    PFS_wall_t *walls;
+    size_t walls_size;
+    int *cells;
+    bool cells_counted;
+} Frame;
+
+typedef struct
+{
+    PFS_t *pfs;
+    PFS_compact_t *compact;
+    FramePipeline *pipeline;
+    atomic_bool show_cells;
+    int subdivisions;
+    int max_subdivisions;
+    int piston_subdivisions;
+    float max_travel;
+    float dt;
+    float freq;
+    float amplitude;
+    float wall_height;
+    float pressure_cell_size;
+    size_t cell_amount_x;
+    size_t cell_amount_y;
+} SimulationThread;
+
+
+static void *simulation_thread(void *arg)
+{
+    SimulationThread *sim = (SimulationThread *)arg;
+    PFS_t *pfs = sim->pfs;
+    PFS_state_t *state = pfs->state;
+    PFS_particle_t *particle;
+    PFS_wall_t *wall;
+    Frame *frame;
+    bool show_cells;
+    int subdivisions;
+    float max_speed;
+    float t = 0;
+    bool compact = (state->solver == PFS_SOLVER_COMPACT);
+
+    // Produces frame N+1 while the main thread draws and encodes frame N.
+    while ((frame = (Frame *)AcquireWriteFrame(sim->pipeline)) != NULL)
+    {
+        show_cells = atomic_load(&sim->show_cells);
+        frame->cells_counted = show_cells;
+        memset(frame->cells, 0, sizeof(int) * sim->cell_amount_x * sim->cell_amount_y);
+
+        // Adaptive policy: enough substeps that no particle travels more than
+        // max_travel radii in one of them.
+        subdivisions = sim->subdivisions;
+        if (subdivisions == 0)
+        {
+            max_speed = 0.0f;
+            for (size_t i=0; i < pfs->particles_size; i++)
+            {
+                particle = &pfs->particles_array[i];
+                max_speed = fmax(max_speed, particle->vel_x * particle->vel_x + particle->vel_y * particle->vel_y);
+            }
+            subdivisions = (int)ceil(sqrt(max_speed) * sim->dt * state->time_speed / (sim->max_travel * state->particle_radius));
+            subdivisions = (subdivisions < 1) ? 1 : (subdivisions > sim->max_subdivisions) ? sim->max_subdivisions : subdivisions;
+        }
+
+        // The piston has its own limit, a coarser sampling aliases it and pumps energy.
+        if (subdivisions < sim->piston_subdivisions)
+            subdivisions = sim->piston_subdivisions;
+
+        // Subdivide time.
+        for (int n = 0; n < subdivisions; n++)
+        {
+            t += sim->dt / (float)subdivisions;
+            
+            // Update walls.
+            for (size_t i=0; i < pfs->walls_size; i++)
+            {
+                wall = &pfs->walls_array[i];
+
+                if (i == 0)
+                {
+                    wall->y = -sim->wall_height / 2.0f + sin(t * 2 * PI * sim->freq * state->time_speed) * sim->amplitude;
+                    wall->vel_y = cos(t * 2 * PI * sim->freq * state->time_speed) * (sim->amplitude * 2 * PI * sim->freq);
+                }
+                if (i == 1)
+                {
+                    wall->y = state->space_height - sim->wall_height / 2.0f + sin(t * 2 * PI * sim->freq * state->time_speed) * sim->amplitude;
+                    wall->vel_y = cos(t * 2 * PI * sim->freq * state->time_speed) * (sim->amplitude * 2 * PI * sim->freq);
+                }
+            }
+
+            // The compact store is only unpacked once per frame.
+            if (compact)
+            {
+                pfs_compact_update(pfs, sim->compact, sim->dt / (float)subdivisions);
+                continue;
+            }
+
+            if (state->solver == PFS_SOLVER_EVENT_DRIVEN)
+                pfs_advance_events(pfs, sim->dt / (float)subdivisions);
+            else
+                pfs_handle_collisions_swept(pfs, sim->dt / (float)subdivisions);
+
+            // Update particles.
+            for (size_t i=0; i < pfs->particles_size; i++)
+            {
+                particle = &pfs->particles_array[i];
+                if (state->solver == PFS_SOLVER_TIME_STEPPED)
+                    pfs_update_particle(pfs, particle, sim->dt / (float)subdivisions);
+                
+                // Count pressure cells.
+                if (show_cells)
+                    for (size_t j=0; j < sim->cell_amount_x; j++)
+                        for (size_t k=0; k < sim->cell_amount_y; k++)
+                            if (particle->x >= j * sim->pressure_cell_size && particle->x <= (j + 1) * sim->pressure_cell_size &&
+                                    particle->y >= k * sim->pressure_cell_size && particle->y <= (k + 1) * sim->pressure_cell_size)
+                                frame->cells[j + k * sim->cell_amount_x]++;
+            }
+
+            if (state->solver == PFS_SOLVER_TIME_STEPPED)
+                pfs_handle_collisions(pfs);
+
+            pfs_update_sources(pfs, sim->dt / (float)subdivisions);
+        }
+
+        // Counted on the frame instead of every substep, weighted to match.
+        if (compact)
+        {
+            pfs_compact_unpack(pfs, sim->compact);
+            if (show_cells)
+                for (size_t i=0; i < pfs->particles_size; i++)
+                {
+                    particle = &pfs->particles_array[i];
+                    for (size_t j=0; j < sim->cell_amount_x; j++)
+                        for (size_t k=0; k < sim->cell_amount_y; k++)
+                            if (particle->x >= j * sim->pressure_cell_size && particle->x <= (j + 1) * sim->pressure_cell_size &&
+                                    particle->y >= k * sim->pressure_cell_size && particle->y <= (k + 1) * sim->pressure_cell_size)
+                                frame->cells[j + k * sim->cell_amount_x] += subdivisions;
+                }
+        }
+
+        frame->particles_size = pfs->particles_size;
+        memcpy(frame->particles, pfs->particles_array, sizeof(PFS_particle_t) * pfs->particles_size);
+        frame->walls_size = pfs->walls_size;
+        memcpy(frame->walls, pfs->walls_array, sizeof(PFS_wall_t) * pfs->walls_size);
+
+        PublishWriteFrame(sim->pipeline);
+    }
+
+    return NULL;
+}
+
+// Pressure cells are only counted while some output shows them.
+static bool outputs_show_cells(SimulationState *simulation_state)
+{
+    for (size_t o=0; o < simulation_state->outputs_size; o++)
+        if (simulation_state->outputs[o].overlays & OVERLAY_PRESSURE)
+            return true;
+
+    return false;
+}
+
+static void print_usage(FILE *stream, const char *program)
+{
+    fprintf(stream,
+            "Usage: %s [options]\n"
+            "Solver options (environment variable in brackets):\n"
+            "  --particles=N                   [PFS_PARTICLES]          default 4000\n"
+            "  --capacity=N                    [PFS_CAPACITY]           particle pool size, default --particles\n"
+            "  --inflow=N                      [PFS_INFLOW]             particles per second entering left, leaving right\n"
+            "  --substeps=N|auto               [PFS_SUBSTEPS]           collision substeps, default 4\n"
+            "  --max-substeps=N                [PFS_MAX_SUBSTEPS]       cap for auto, default 64\n"
+            "  --max-travel=RADII              [PFS_MAX_TRAVEL]         auto target per substep, default 0.5\n"
+            "  --piston-step=RAD               [PFS_PISTON_STEP]        largest piston phase per substep, default 0.5\n"
+            "  --solver=stepped|events|compact [PFS_SOLVER]             default stepped\n"
+            "  --broadphase=grid|brute-force   [PFS_BROADPHASE]         default grid\n"
+            "  --contact-solver=gauss-seidel|jacobi [PFS_CONTACT_SOLVER] default gauss-seidel\n"
+            "  --contact-iterations=N          [PFS_CONTACT_ITERATIONS] default 4\n"
+            "  --contact-relaxation=F          [PFS_CONTACT_RELAXATION] default 1.0\n"
+            "  --warm-start=F                  [PFS_WARM_START]         default 0.8\n"
+            "  --bounce-threshold=M/S          [PFS_BOUNCE_THRESHOLD]   slowest impact that bounces, default 0.01\n"
+            "  --open-boundaries               [PFS_OPEN_BOUNDARIES]\n"
+            "  --threads=N                     [PFS_THREADS]            Jacobi solver threads, needs OpenMP\n",
+            program);
+    PrintSimulationUsage(stream);
+}
+
+int main(int argc, char **argv)
 {
-    const size_t particle_amount = 4000;
     const float particle_radius = 1.0f;
+    const char *value;
+
+    if (GetOption(argc, argv, "help", NULL) != NULL)
+    {
+        print_usage(stdout, argv[0]);
+        return 0;
+    }
 
-    PFS_state_t state;
-    state.pixel_to_meter = 0.0001f;
-    state.space_width = 0.01;
-    state.space_height = 0.03;
+    SimulationState simulation_state;
+    ParseSimulationState(&simulation_state, argc, argv);
+
+    const int particle_amount = GetOptionInt(argc, argv, "particles", "PFS_PARTICLES", 4000);
+    if (particle_amount <= 0)
+    {
+        fprintf(stderr, "ERROR: '%d' is not a valid particle count.\n", particle_amount);
+        exit(EXIT_FAILURE);
+    }
+
+    PFS_state_t state = pfs_state_default();
     state.particle_radius = particle_radius * state.pixel_to_meter;
-    state.time_speed = 0.005f;
-    state.start_velocity_magnitude = 0.9f;
-    state.g = 9.8066;
-    state.e = 1.0f;
+    state.open_boundaries = GetOptionBool(argc, argv, "open-boundaries", "PFS_OPEN_BOUNDARIES", state.open_boundaries);
+    state.contact_iterations = GetOptionInt(argc, argv, "contact-iterations", "PFS_CONTACT_ITERATIONS", state.contact_iterations);
+    state.contact_relaxation = GetOptionFloat(argc, argv, "contact-relaxation", "PFS_CONTACT_RELAXATION", state.contact_relaxation);
+    state.contact_warm_start = GetOptionFloat(argc, argv, "warm-start", "PFS_WARM_START", state.contact_warm_start);
+    state.contact_bounce_threshold = GetOptionFloat(argc, argv, "bounce-threshold", "PFS_BOUNCE_THRESHOLD", state.contact_bounce_threshold);
+
+    value = GetOption(argc, argv, "solver", "PFS_SOLVER");
+    if (value == NULL || strcmp(value, "stepped") == 0)
+        state.solver = PFS_SOLVER_TIME_STEPPED;
+    else if (strcmp(value, "events") == 0)
+        state.solver = PFS_SOLVER_EVENT_DRIVEN;
+    else if (strcmp(value, "compact") == 0)
+        state.solver = PFS_SOLVER_COMPACT;
+    else
+    {
+        fprintf(stderr, "ERROR: '%s' is not a valid solver.\n", value);
+        exit(EXIT_FAILURE);
+    }
+
+    value = GetOption(argc, argv, "broadphase", "PFS_BROADPHASE");
+    if (value == NULL || strcmp(value, "grid") == 0)
+        state.broadphase = PFS_BROADPHASE_GRID;
+    else if (strcmp(value, "brute-force") == 0)
+        state.broadphase = PFS_BROADPHASE_BRUTE_FORCE;
+    else
+    {
+        fprintf(stderr, "ERROR: '%s' is not a valid broadphase.\n", value);
+        exit(EXIT_FAILURE);
+    }
+
+    value = GetOption(argc, argv, "contact-solver", "PFS_CONTACT_SOLVER");
+    if (value == NULL || strcmp(value, "gauss-seidel") == 0)
+        state.contact_solver = PFS_CONTACT_GAUSS_SEIDEL;
+    else if (strcmp(value, "jacobi") == 0)
+        state.contact_solver = PFS_CONTACT_JACOBI;
+    else
+    {
+        fprintf(stderr, "ERROR: '%s' is not a valid contact solver.\n", value);
+        exit(EXIT_FAILURE);
+    }
+
+    const int threads = GetOptionInt(argc, argv, "threads", "PFS_THREADS", 0);
+#ifdef _OPENMP
+    if (threads > 0)
+        omp_set_num_threads(threads);
+#else
+    if (threads > 1)
+        printf("NOTE: built without OpenMP, --threads is ignored.\n");
+#endif
 
     PFS_t pfs;
     pfs_create(&pfs, &state, particle_amount);
+    const int capacity = GetOptionInt(argc, argv, "capacity", "PFS_CAPACITY", particle_amount);
+    if (capacity < particle_amount)
+    {
+        fprintf(stderr, "ERROR: The capacity %d can not hold %d particles.\n", capacity, particle_amount);
+        exit(EXIT_FAILURE);
+    }
+    pfs_reserve(&pfs, capacity);
     pfs_start_random(&pfs);
+
+    // Inflow through the middle of the left side, outflow through the right.
+    // The rate is per second of animation, not of simulated time.
+    const float inflow = GetOptionFloat(argc, argv, "inflow", "PFS_INFLOW", 0.0f);
+    if (state.solver == PFS_SOLVER_COMPACT && (inflow > 0.0f || state.open_boundaries))
+    {
+        fprintf(stderr, "ERROR: The compact solver supports neither inflow nor open boundaries.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (inflow > 0.0f)
+    {
+        pfs_add_emitter(&pfs, 0.0f, state.space_height / 3.0f, 2.0f * state.particle_radius, state.space_height / 3.0f,
+                inflow / state.time_speed, state.start_velocity_magnitude, 0.0f);
+        pfs_add_sink(&pfs, state.space_width - 2.0f * state.particle_radius, state.space_height / 3.0f,
+                2.0f * state.particle_radius, state.space_height / 3.0f);
+    }
     
     const float amplitude = 0.0001f;
     const float wall_width = state.space_width;
@@ -31,138 +306,169 @@ int main(void)
     pfs_add_wall(&pfs, state.space_width / 2.0f - wall_width / 2.0f, -wall_height / 2.0f, wall_width, wall_height);
     pfs_add_wall(&pfs, state.space_width / 2.0f - wall_width / 2.0f, state.space_height - wall_height / 2.0f, wall_width, wall_height);
 
-    PFS_particle_t *particle;
     PFS_wall_t *wall;
      
-    float t = 0;
-    const int FPS = 60;
-    const float dt = 1.0f / FPS;
-    const int subdivisions = 20;
     const float freq = 40000;
 
     const float min_vel = 500.0f;
     const float max_vel = 2000.0f;
-    float vel_mag_squared;
     float alpha;
     Color color;
     
-    bool show_cells = 0;
     const float pressure_cell_size = 5.0f * state.pixel_to_meter;
     const size_t cell_amount_x = (size_t)(state.space_width / pressure_cell_size);
     const size_t cell_amount_y = (size_t)(state.space_height / pressure_cell_size);
-    int cells[cell_amount_x * cell_amount_y];
 
-    for (size_t i=0; i < cell_amount_x * cell_amount_y; i++)
-        cells[i] = 0;
+    Frame frames[2];
+    for (size_t i=0; i < 2; i++)
+    {
+        frames[i].particles = (PFS_particle_t *)malloc(sizeof(PFS_particle_t) * pfs.particles_capacity);
+        frames[i].particles_size = 0;
+        frames[i].walls = (PFS_wall_t *)malloc(sizeof(PFS_wall_t) * pfs.walls_size);
+        frames[i].walls_size = 0;
+        frames[i].cells = (int *)calloc(cell_amount_x * cell_amount_y, sizeof(int));
+        frames[i].cells_counted = false;
+    }
+
+    FramePipeline *pipeline = CreateFramePipeline(&frames[0], &frames[1]);
+
+    PFS_compact_t compact = { 0 };
+    if (state.solver == PFS_SOLVER_COMPACT)
+    {
+        pfs_compact_create(&compact, pfs.particles_capacity);
+        pfs_compact_pack(&pfs, &compact);
+    }
+
+    SimulationThread sim;
+    sim.pfs = &pfs;
+    sim.compact = &compact;
+    sim.pipeline = pipeline;
+    atomic_init(&sim.show_cells, false);
+    value = GetOption(argc, argv, "substeps", "PFS_SUBSTEPS");
+    sim.subdivisions = (value != NULL && strcmp(value, "auto") == 0) ? 0 : GetOptionInt(argc, argv, "substeps", "PFS_SUBSTEPS", 4);
+    sim.max_subdivisions = GetOptionInt(argc, argv, "max-substeps", "PFS_MAX_SUBSTEPS", 64);
+    sim.max_travel = GetOptionFloat(argc, argv, "max-travel", "PFS_MAX_TRAVEL", 0.5f);
+    const float piston_step = GetOptionFloat(argc, argv, "piston-step", "PFS_PISTON_STEP", 0.5f);
+    if (sim.subdivisions < 0 || sim.max_subdivisions < 1 || sim.max_travel <= 0.0f || piston_step <= 0.0f)
+    {
+        fprintf(stderr, "ERROR: Substep counts, travel and piston step must be positive.\n");
+        exit(EXIT_FAILURE);
+    }
+    sim.dt = simulation_state.dt;
+    sim.piston_subdivisions = (int)ceil(2 * PI * freq * state.time_speed * sim.dt / piston_step);
+    sim.freq = freq;
+    sim.amplitude = amplitude;
+    sim.wall_height = wall_height;
+    sim.pressure_cell_size = pressure_cell_size;
+    sim.cell_amount_x = cell_amount_x;
+    sim.cell_amount_y = cell_amount_y;
+
+    // Every option has been looked up by now, anything else is a typo.
+    CheckOptions(argc, argv);
 
     const int world_width = 1920;
     const int world_height = 1080;
-    
-    SimulationState simulation_state;
-    CreateSimulationState(&simulation_state, RENDER, world_width, world_height, FPS, 2.5); 
+
     InitSimulation(&simulation_state, (Vector2){ world_width, world_height }, "PFS - Test");
+    ParticleRenderer *particle_renderer = LoadParticleRenderer(pfs.particles_capacity);
     //InitWindow(1280, 720, "PFS - Test");
     //ToggleFullscreen();
     //SetTargetFPS(FPS);
 
+    pthread_t thread;
+    atomic_store(&sim.show_cells, outputs_show_cells(&simulation_state));
+    pthread_create(&thread, NULL, simulation_thread, &sim);
+    Frame *frame;
+    unsigned int overlays;
+
     while (!WindowShouldClose())
     {
-        
-        // Subdivide time.
-        for (int n = 0; n < subdivisions; n++)
-        {
-            t += dt / (float)subdivisions;
-            
-            // Update walls.
-            for (size_t i=0; i < pfs.walls_size; i++)
-            {
-                wall = &pfs.walls_array[i];
+        if ((frame = (Frame *)AcquireReadFrame(pipeline)) == NULL)
+            break;
 
-                if (i == 0)
-                {
-                    wall->y = -wall_height / 2.0f + sin(t * 2 * PI * freq * state.time_speed) * amplitude;
-                    wall->vel_y = cos(t * 2 * PI * freq * state.time_speed) * (amplitude * 2 * PI * freq);
-                }
-                if (i == 1)
-                {
-                    wall->y = state.space_height - wall_height / 2.0f + sin(t * 2 * PI * freq * state.time_speed) * amplitude;
-                    wall->vel_y = cos(t * 2 * PI * freq * state.time_speed) * (amplitude * 2 * PI * freq);
-                }
-            }
+        if (IsKeyPressed(KEY_SPACE))
+            simulation_state.outputs[0].overlays ^= OVERLAY_PRESSURE;
 
-            // Update particles.
-            for (size_t i=0; i < pfs.particles_size; i++)
-            {
-                particle = &pfs.particles_array[i];
-                pfs_update_particle(&pfs, particle, dt / (float)subdivisions);
-                
-                // Draw pressure cells.
-                if (show_cells)
-                    for (size_t j=0; j < cell_amount_x; j++)
-                        for (size_t k=0; k < cell_amount_y; k++)
-                            if (particle->x >= j * pressure_cell_size && particle->x <= (j + 1) * pressure_cell_size &&
-                                    particle->y >= k * pressure_cell_size && particle->y <= (k + 1) * pressure_cell_size)
-                                cells[j + k * cell_amount_x]++;
-            }
-            
-            pfs_handle_collisions(&pfs);
-        }
+        atomic_store(&sim.show_cells, outputs_show_cells(&simulation_state));
 
         BeginSimulationMode(&simulation_state, BLACK);
         //BeginDrawing();
         //ClearBackground(BLACK);
 
-        if (IsKeyPressed(KEY_SPACE))
-            show_cells = !(show_cells);
-        
-        // Draw particles.
-        for (size_t i=0; i < pfs.particles_size; i++)
-        {
-            particle = &pfs.particles_array[i];
-
-            vel_mag_squared = pow(particle->vel_x, 2) + pow(particle->vel_y, 2);
-            alpha = fmax(fmin((vel_mag_squared - min_vel) / max_vel, 1), 0);
-            color = (Color){ 255 * alpha, 0.0f, 255 * (1.0f - alpha), 255 * alpha };
-
-            DrawCircle(particle->x / state.pixel_to_meter, particle->y / state.pixel_to_meter, particle_radius, color);
-        }
-        
-        // Draw walls.
-        for (size_t i=0; i < pfs.walls_size; i++)
+        // Every output draws the same simulated frame.
+        for (size_t o=0; o < simulation_state.outputs_size; o++)
         {
-            wall = &pfs.walls_array[i];
+            if (o > 0)
+                BeginRenderOutput(&simulation_state, o, BLACK);
+            overlays = simulation_state.outputs[o].overlays;
 
-            DrawRectangle(
-                    wall->x / state.pixel_to_meter, wall->y / state.pixel_to_meter, 
-                    wall->width / state.pixel_to_meter, wall->height / state.pixel_to_meter,
-                    GRAY);
-        }
-        
-        // Draw pressure cells.
-        if (show_cells)
-        {
-            for (size_t j=0; j < cell_amount_x; j++)
-                for (size_t k=0; k < cell_amount_y; k++)
+            // Draw particles.
+            if (overlays & OVERLAY_PARTICLES)
+                DrawParticlesInstanced(particle_renderer, frame->particles, frame->particles_size,
+                        1.0f / state.pixel_to_meter, particle_radius, min_vel, max_vel);
+            
+            // Draw walls.
+            if (overlays & OVERLAY_WALLS)
+                for (size_t i=0; i < frame->walls_size; i++)
                 {
-                    alpha = 200.0f * cells[j + k * cell_amount_x] / particle_amount;
-                    color = (Color){ 0, 255 * pow(alpha, 2), 0, 200 };
+                    wall = &frame->walls[i];
+
                     DrawRectangle(
-                            j * pressure_cell_size / state.pixel_to_meter, 
-                            k * pressure_cell_size / state.pixel_to_meter,
-                            pressure_cell_size / state.pixel_to_meter, 
-                            pressure_cell_size / state.pixel_to_meter, 
-                            color); 
-                    cells[j + k * cell_amount_x] = 0; 
+                            wall->x / state.pixel_to_meter, wall->y / state.pixel_to_meter, 
+                            wall->width / state.pixel_to_meter, wall->height / state.pixel_to_meter,
+                            GRAY);
                 }
+            
+            // Draw pressure cells.
+            // Frames solved before a toggle have no counts, skip them instead of
+            // drawing empty cells.
+            if ((overlays & OVERLAY_PRESSURE) && frame->cells_counted)
+            {
+                for (size_t j=0; j < cell_amount_x; j++)
+                    for (size_t k=0; k < cell_amount_y; k++)
+                    {
+                        alpha = 200.0f * frame->cells[j + k * cell_amount_x] / particle_amount;
+                        color = (Color){ 0, 255 * pow(alpha, 2), 0, 200 };
+                        DrawRectangle(
+                                j * pressure_cell_size / state.pixel_to_meter, 
+                                k * pressure_cell_size / state.pixel_to_meter,
+                                pressure_cell_size / state.pixel_to_meter, 
+                                pressure_cell_size / state.pixel_to_meter, 
+                                color); 
+                    }
+            }
         }
 
+        // Everything is batched or uploaded, the solver can refill this slot
+        // while the frame is read back and encoded.
+        ReleaseReadFrame(pipeline);
+
         if (!EndSimulationMode(&simulation_state))
             break;
         //EndDrawing();
 
     }
 
+    StopFramePipeline(pipeline);
+    pthread_join(thread, NULL);
+    CloseFramePipeline(pipeline);
+
+    for (size_t i=0; i < 2; i++)
+    {
+        free(frames[i].particles);
+        free(frames[i].walls);
+        free(frames[i].cells);
+    }
+
+    if (state.solver == PFS_SOLVER_COMPACT)
+    {
+        if (compact.clamped > 0)
+            printf("NOTE: %zu velocities were clamped by the compact store.\n", compact.clamped);
+        pfs_compact_close(&compact);
+    }
+
     pfs_close(&pfs);
+    UnloadParticleRenderer(particle_renderer);
     CloseSimulation(&simulation_state);
     //CloseWindow();
 
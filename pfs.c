@@ -1,4 +1,9 @@
-#include "pfs.h"
+#include "pfs_internal.h"
+#include <string.h>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 
 static void project_wall(float wall_points_x[4], float wall_points_y[4], float axis_x, float axis_y, float *min_proj, float *max_proj)
@@ -51,39 +56,10 @@ static void find_closest_point(PFS_particle_t *p, float wall_points_x[4], float
     }
 }
 
-static int collide_particles(float e, float radius, PFS_particle_t *p0, PFS_particle_t *p1)
-{
-    float dist_x = p1->x - p0->x;
-    float dist_y = p1->y - p0->y;
-    float dist_squared = pow(dist_x, 2) + pow(dist_y, 2);
-
-    if (dist_squared < pow(radius, 2))
-    {
-        float normal_x = dist_x / sqrt(dist_squared);
-        float normal_y = dist_y / sqrt(dist_squared);
-
-        float rvel_x = p0->vel_x - p1->vel_x;
-        float rvel_y = p0->vel_y - p1->vel_y;
-
-        float imp = -(1.0f + e) * (rvel_x * normal_x + rvel_y * normal_y) / (2.0f * (normal_x * normal_x + normal_y * normal_y));
-
-        p0->vel_x += normal_x * imp;
-        p0->vel_y += normal_y * imp;
-        p1->vel_x -= normal_x * imp;
-        p1->vel_y -= normal_y * imp;
-
-        p0->x += normal_x * radius;
-        p0->y += normal_y * radius;
-        p1->x -= normal_x * radius;
-        p1->y -= normal_y * radius;
-        
-        return true;
-    }
-
-    return false;
-}
-
-static int collide_particle_wall(float e, float radius, PFS_particle_t *p, PFS_wall_t *wall)
+// Separating axis test of a particle against a wall. On overlap returns 1
+// with the unit normal pointing from the wall to the particle and the
+// penetration depth along it.
+static int wall_contact(float radius, PFS_particle_t *p, PFS_wall_t *wall, float *contact_normal_x, float *contact_normal_y, float *depth)
 {
     float wall_points_x[4];
     float wall_points_y[4];
@@ -108,8 +84,8 @@ static int collide_particle_wall(float e, float radius, PFS_particle_t *p, PFS_w
     float axis_x;
     float axis_y;
     float axis_magnitude;
-    float normal_x;
-    float normal_y;
+    float normal_x = 1.0f;
+    float normal_y = 0.0f;
     
     float minA;
     float maxA;
@@ -150,11 +126,11 @@ static int collide_particle_wall(float e, float radius, PFS_particle_t *p, PFS_w
         }
     }
     
-    float closest_x;
-    float closest_y;
+    float closest_x = wall_points_x[0];
+    float closest_y = wall_points_y[0];
     find_closest_point(p, wall_points_x, wall_points_y, &closest_x, &closest_y);                
     axis_x = closest_x - p->x;
-    axis_y = closest_y - p->x;
+    axis_y = closest_y - p->y;
 
     axis_magnitude = sqrt(pow(axis_x, 2) + pow(axis_y, 2));
     axis_x /= axis_magnitude;
@@ -180,179 +156,2088 @@ static int collide_particle_wall(float e, float radius, PFS_particle_t *p, PFS_w
         normal_x *= -1.0f;
         normal_y *= -1.0f;
     }
-    
-    float rvel_x = p->vel_x - wall->vel_x;
-    float rvel_y = p->vel_y - wall->vel_y;
-    float imp = -(1.0f + e) * (rvel_x * normal_x + rvel_y * normal_y) / (normal_x * normal_x + normal_y * normal_y);
 
-    p->vel_x += normal_x * imp;
-    p->vel_y += normal_y * imp;
-    p->x += normal_x * min_depth;
-    p->y += normal_y * min_depth;
+    *contact_normal_x = normal_x;
+    *contact_normal_y = normal_y;
+    *depth = min_depth;
 
     return 1;
 }
 
-void pfs_create(PFS_t *pfs, PFS_state_t *state, size_t particles_size)
+// Discrete resolution for overlaps the swept and event passes cannot handle.
+// Only an approaching particle is bounced, a separating one is just pushed out.
+static int collide_particle_wall(float e, float radius, PFS_particle_t *p, PFS_wall_t *wall)
 {
-    srand(time(0));
-    pfs->state = state;
-    pfs->particles_size = particles_size;
-    pfs->walls_size = 0;
-    pfs->walls_capacity = 0;
-    pfs->particles_array = (PFS_particle_t *)malloc(sizeof(PFS_particle_t) * particles_size);
+    float normal_x;
+    float normal_y;
+    float depth;
+    float approach;
+
+    if (!wall_contact(radius, p, wall, &normal_x, &normal_y, &depth))
+        return 0;
+
+    approach = (p->vel_x - wall->vel_x) * normal_x + (p->vel_y - wall->vel_y) * normal_y;
+    if (approach < 0.0f)
+    {
+        p->vel_x -= (1.0f + e) * approach * normal_x;
+        p->vel_y -= (1.0f + e) * approach * normal_y;
+    }
+    p->x += normal_x * depth;
+    p->y += normal_y * depth;
+
+    return 1;
 }
 
-void pfs_start_random(PFS_t *pfs)
+static int time_of_impact_circle(float dist_x, float dist_y, float rvel_x, float rvel_y, float contact_distance, float max_time, float *toi)
 {
-    float random_angle;
-    PFS_particle_t *particle;
+    // Solves |dist + rvel * t| = contact_distance for the first t in [0, max_time].
+    float a = rvel_x * rvel_x + rvel_y * rvel_y;
+    float b = dist_x * rvel_x + dist_y * rvel_y;
+    float c = dist_x * dist_x + dist_y * dist_y - contact_distance * contact_distance;
 
-    for (size_t i=0; i < pfs->particles_size; i++)
+    if (b >= 0.0f)
+        return 0;
+
+    if (c < 0.0f)
     {
-        particle = &pfs->particles_array[i];
+        *toi = 0.0f;
+        return 1;
+    }
 
-        random_angle = ((float)rand() / RAND_MAX) * 2.0f * M_PI;
-        particle->vel_x = cos(random_angle) * pfs->state->start_velocity_magnitude;
-        particle->vel_y = -sin(random_angle) * pfs->state->start_velocity_magnitude;
-        particle->x = ((float)rand() / RAND_MAX) * pfs->state->space_width; 
-        particle->y = ((float)rand() / RAND_MAX) * pfs->state->space_height; 
+    float discriminant = b * b - a * c;
+    if (discriminant < 0.0f)
+        return 0;
+
+    float t = (-b - sqrt(discriminant)) / a;
+    if (t > max_time)
+        return 0;
+
+    *toi = fmax(t, 0.0f);
+    return 1;
+}
+
+static int sweep_particles(float radius, float max_time, PFS_particle_t *p0, PFS_particle_t *p1, float *toi)
+{
+    return time_of_impact_circle(
+            p1->x - p0->x, p1->y - p0->y,
+            p1->vel_x - p0->vel_x, p1->vel_y - p0->vel_y,
+            radius, max_time, toi);
+}
+
+// Real roots of position + velocity * t + acceleration * t^2 / 2 = target in
+// increasing order, acceleration must not be zero.
+static int crossing_roots(float position, float velocity, float acceleration, float target, float roots[2])
+{
+    float c = position - target;
+    float discriminant = velocity * velocity - 2.0f * acceleration * c;
+    float q;
+
+    if (discriminant < 0.0f)
+        return 0;
+
+    q = -0.5f * (velocity + copysign(sqrt(discriminant), velocity));
+    if (q == 0.0f)
+    {
+        roots[0] = roots[1] = 0.0f;
+        return 2;
     }
+    roots[0] = fmin(q / (0.5f * acceleration), c / q);
+    roots[1] = fmax(q / (0.5f * acceleration), c / q);
+    return 2;
 }
 
-void pfs_add_wall(PFS_t *pfs, float x, float y, float width, float height)
+// First time the center passes target moving in direction (+1 or -1), in the
+// past only if it is still beyond it.
+static float crossing_time(float position, float velocity, float acceleration, float target, float direction)
+{
+    float roots[2];
+
+    if (acceleration == 0.0f)
+        return (velocity * direction > 0.0f) ? (target - position) / velocity : INFINITY;
+
+    if (crossing_roots(position, velocity, acceleration, target, roots) == 0)
+        return INFINITY;
+
+    for (int r=0; r < 2; r++)
+        if ((velocity + acceleration * roots[r]) * direction > 0.0f)
+            return (roots[r] >= 0.0f || (position - target) * direction > 0.0f) ? roots[r] : INFINITY;
+
+    return INFINITY;
+}
+
+// Times the center is within [min, max] along one axis, in order. A parabola
+// can pass through the slab twice.
+static int slab_intervals(float position, float velocity, float acceleration, float min, float max, float enter[2], float exit[2])
 {
-    if (pfs->walls_capacity == 0)
+    float upper[2];
+    float lower[2];
+    float temp;
+
+    if (acceleration == 0.0f)
     {
-        pfs->walls_capacity = 2;
-        pfs->walls_array = (PFS_wall_t *)malloc(sizeof(PFS_wall_t) * pfs->walls_capacity);
+        if (velocity == 0.0f)
+        {
+            enter[0] = -INFINITY;
+            exit[0] = INFINITY;
+            return (position < min || max < position) ? 0 : 1;
+        }
+        enter[0] = (min - position) / velocity;
+        exit[0] = (max - position) / velocity;
+        if (enter[0] > exit[0])
+        {
+            temp = enter[0];
+            enter[0] = exit[0];
+            exit[0] = temp;
+        }
+        return 1;
     }
 
-    pfs->walls_array[pfs->walls_size].x = x;
-    pfs->walls_array[pfs->walls_size].y = y;
-    pfs->walls_array[pfs->walls_size].width = width;
-    pfs->walls_array[pfs->walls_size].height = height;
-    pfs->walls_array[pfs->walls_size].vel_x = 0.0f;
-    pfs->walls_array[pfs->walls_size].vel_y = 0.0f;
+    // Mirrored so that the parabola always opens towards max.
+    if (acceleration < 0.0f)
+    {
+        temp = min;
+        min = -max;
+        max = -temp;
+        position = -position;
+        velocity = -velocity;
+        acceleration = -acceleration;
+    }
+
+    if (crossing_roots(position, velocity, acceleration, max, upper) == 0)
+        return 0;
 
-    if (pfs->walls_size++ == pfs->walls_capacity)
+    enter[0] = upper[0];
+    exit[1] = upper[1];
+    if (crossing_roots(position, velocity, acceleration, min, lower) == 0 || lower[0] == lower[1])
     {
-        pfs->walls_capacity *= 2;
-        pfs->walls_array = (PFS_wall_t *)malloc(sizeof(PFS_wall_t) * pfs->walls_capacity);
+        exit[0] = upper[1];
+        return 1;
     }
+    exit[0] = lower[0];
+    enter[1] = lower[1];
+    return 2;
 }
 
-void pfs_update_particle(PFS_t *pfs, PFS_particle_t *particle, float delta_time)
+static int sweep_particle_wall(float radius, float max_time, float accel_y, PFS_particle_t *p, PFS_wall_t *wall, float *toi, float *normal_x, float *normal_y)
 {
-    float random_angle;
-    float real_delta_time = delta_time * pfs->state->time_speed;
-    //int border;
+    // Ray cast of the particle center against the wall expanded by the radius,
+    // done in the wall's frame so moving pistons are swept as well. With
+    // accel_y the path is a parabola, walls themselves never accelerate.
+    float rvel_x = p->vel_x - wall->vel_x;
+    float rvel_y = p->vel_y - wall->vel_y;
+    float min_x = wall->x - radius;
+    float min_y = wall->y - radius;
+    float max_x = wall->x + wall->width + radius;
+    float max_y = wall->y + wall->height + radius;
+    float enter_x[2], exit_x[2];
+    float enter_y[2], exit_y[2];
+    float enter = INFINITY;
+    float exit = -INFINITY;
+    int intervals_y;
+    int k;
 
-    particle->x += particle->vel_x * real_delta_time;
-    particle->y += particle->vel_y * real_delta_time;
-    particle->vel_y += pfs->state->g * real_delta_time; 
+    if (slab_intervals(p->x, rvel_x, 0.0f, min_x, max_x, enter_x, exit_x) == 0)
+        return 0;
+    intervals_y = slab_intervals(p->y, rvel_y, accel_y, min_y, max_y, enter_y, exit_y);
 
-    if (particle->x < 0 || pfs->state->space_width < particle->x || particle->y < 0 || pfs->state->space_height < particle->y)
+    for (k=0; k < intervals_y; k++)
     {
-        random_angle = ((float)rand() / RAND_MAX) * 2.0f * M_PI;
-        particle->vel_x = cos(random_angle) * pfs->state->start_velocity_magnitude;
-        particle->vel_y = -sin(random_angle) * pfs->state->start_velocity_magnitude;
-        
-        bool intersect = true;
-        while (intersect)
+        enter = fmax(enter_x[0], enter_y[k]);
+        exit = fmin(exit_x[0], exit_y[k]);
+        if (enter <= exit && exit >= 0.0f)
+            break;
+    }
+
+    if (k == intervals_y || enter > max_time)
+        return 0;
+
+    if (enter < 0.0f)
+        return -1;
+
+    float hit_x = p->x + rvel_x * enter;
+    float hit_y = p->y + (rvel_y + 0.5f * accel_y * enter) * enter;
+    bool outside_x = hit_x < wall->x || wall->x + wall->width < hit_x;
+    bool outside_y = hit_y < wall->y || wall->y + wall->height < hit_y;
+
+    if (outside_x && outside_y)
+    {
+        // The expanded box has rounded corners, test against the corner itself.
+        float corner_x = (hit_x < wall->x) ? wall->x : wall->x + wall->width;
+        float corner_y = (hit_y < wall->y) ? wall->y : wall->y + wall->height;
+
+        if (accel_y == 0.0f)
         {
-            particle->x = pfs->state->space_width * (float)rand() / RAND_MAX;
-            particle->y = pfs->state->space_height * (float)rand() / RAND_MAX;
-        
-            for (size_t i=0; i < pfs->walls_size; i++)
+            if (!time_of_impact_circle(p->x - corner_x, p->y - corner_y, rvel_x, rvel_y, radius, max_time, &enter))
+                return 0;
+        } else
+        {
+            // Newton from the box entry, which is never later than the corner hit.
+            float distance_x;
+            float distance_y;
+            float gap;
+            float slope;
+
+            for (int n=0; n < 8; n++)
             {
-                PFS_wall_t *wall = &pfs->walls_array[i];
-                intersect = wall->x < particle->x && particle->x < wall->x + wall->width &&
-                            wall->y < particle->y && particle->y < wall->y + wall->height;
-                if (!intersect)
+                distance_x = p->x + rvel_x * enter - corner_x;
+                distance_y = p->y + (rvel_y + 0.5f * accel_y * enter) * enter - corner_y;
+                gap = distance_x * distance_x + distance_y * distance_y - radius * radius;
+                if (gap <= 1e-6f * radius * radius)
                     break;
+
+                slope = 2.0f * (distance_x * rvel_x + distance_y * (rvel_y + accel_y * enter));
+                if (slope >= 0.0f)
+                    return 0;
+                enter -= gap / slope;
             }
+            if (gap > 1e-6f * radius * radius || enter > max_time)
+                return 0;
         }
 
-       /*border = rand() % 2;
+        *normal_x = (p->x + rvel_x * enter - corner_x) / radius;
+        *normal_y = (p->y + (rvel_y + 0.5f * accel_y * enter) * enter - corner_y) / radius;
+    } else if (enter_x[0] > enter_y[k])
+    {
+        *normal_x = (rvel_x > 0.0f) ? -1.0f : 1.0f;
+        *normal_y = 0.0f;
+    } else
+    {
+        *normal_x = 0.0f;
+        *normal_y = (rvel_y + accel_y * enter > 0.0f) ? -1.0f : 1.0f;
+    }
 
-        switch (border)
-        {
-            case 0:
-                particle->x = 0;
-                particle->y = ((float)rand() / RAND_MAX) * pfs->state->space_height;
-                break;
+    *toi = enter;
+    return 1;
+}
 
-            case 1:
-                particle->x = pfs->state->space_width;
-                particle->y = ((float)rand() / RAND_MAX) * pfs->state->space_height;
-                break;
+static void contact_push(PFS_contact_solver_t *cs, PFS_contact_t contact)
+{
+    if (cs->contacts_size == cs->contacts_capacity)
+    {
+        cs->contacts_capacity = (cs->contacts_capacity == 0) ? 1024 : cs->contacts_capacity * 2;
+        cs->contacts = (PFS_contact_t *)realloc(cs->contacts, sizeof(PFS_contact_t) * cs->contacts_capacity);
+    }
 
-            default:
-                break;
-        }*/
+    cs->contacts[cs->contacts_size++] = contact;
+}
 
-        /*border = rand() % 4;
+static size_t cell_coord(float position, float cell_size, size_t cells)
+{
+    if (position <= 0.0f)
+        return 0;
 
-        switch (border)
-        {
-            case 0:
-                particle->x = ((float)rand() / RAND_MAX) * pfs->state->space_width;
-                particle->y = 0;
-                break;
+    // Clamped before the conversion, swept boxes can reach far outside.
+    float coord = position / cell_size;
+    return (coord >= (float)cells) ? cells - 1 : (size_t)coord;
+}
 
-            case 1:
-                particle->x = 0;
-                particle->y = ((float)rand() / RAND_MAX) * pfs->state->space_height;
-                break;
+static void grid_build(PFS_t *pfs, float cell_size)
+{
+    PFS_grid_t *grid = &pfs->internal->grid;
+    PFS_state_t *state = pfs->state;
+    PFS_particle_t *particle;
+    size_t n = pfs->particles_size;
+    size_t cells;
+    size_t cell;
+    size_t x;
+    size_t y;
 
-            case 2:
-                particle->x = ((float)rand() / RAND_MAX) * pfs->state->space_width;
-                particle->y = pfs->state->space_height;
-                break;
+    // Never more cells than a few per particle, however small the reach is.
+    grid->cell_size = fmax(cell_size, sqrt(state->space_width * state->space_height / (4.0f * (n > 0 ? n : 1))));
+    grid->cells_x = (size_t)fmax(1.0f, state->space_width / grid->cell_size);
+    grid->cells_y = (size_t)fmax(1.0f, state->space_height / grid->cell_size);
+    cells = grid->cells_x * grid->cells_y;
 
-            case 3:
-                particle->x = pfs->state->space_width;
-                particle->y = ((float)rand() / RAND_MAX) * pfs->state->space_height;
-                break;
+    if (grid->particles_capacity < pfs->particles_capacity)
+    {
+        grid->particles_capacity = pfs->particles_capacity;
+        grid->cell_particles = (size_t *)realloc(grid->cell_particles, sizeof(size_t) * grid->particles_capacity);
+        grid->particle_cell = (size_t *)realloc(grid->particle_cell, sizeof(size_t) * grid->particles_capacity);
+    }
+    if (grid->cells_capacity < cells + 1)
+    {
+        grid->cells_capacity = cells + 1;
+        grid->cell_start = (size_t *)realloc(grid->cell_start, sizeof(size_t) * grid->cells_capacity);
+    }
 
-            default:
-                break;
-        }*/
+    // Counting sort: count per cell, prefix sum, scatter, then shift the
+    // bumped offsets back by one cell.
+    memset(grid->cell_start, 0, sizeof(size_t) * (cells + 1));
+    for (size_t i=0; i < n; i++)
+    {
+        particle = &pfs->particles_array[i];
+        x = cell_coord(particle->x, grid->cell_size, grid->cells_x);
+        y = cell_coord(particle->y, grid->cell_size, grid->cells_y);
+        grid->particle_cell[i] = x + y * grid->cells_x;
+        grid->cell_start[grid->particle_cell[i] + 1]++;
+    }
+    for (size_t c=0; c < cells; c++)
+        grid->cell_start[c + 1] += grid->cell_start[c];
+    for (size_t i=0; i < n; i++)
+    {
+        cell = grid->particle_cell[i];
+        grid->cell_particles[grid->cell_start[cell]++] = i;
     }
+    for (size_t c=cells; c > 0; c--)
+        grid->cell_start[c] = grid->cell_start[c - 1];
+    grid->cell_start[0] = 0;
 }
 
-void pfs_handle_collisions(PFS_t *pfs)
+// Calls pair(pfs, i, j, data) once for every i < j in the same or in
+// neighbouring cells.
+static void grid_for_each_pair(PFS_t *pfs, void (*pair)(PFS_t *, size_t, size_t, void *), void *data)
 {
-    PFS_particle_t *p0;
+    PFS_grid_t *grid = &pfs->internal->grid;
+    size_t cx;
+    size_t cy;
+    size_t cell;
+    size_t j;
+
+    for (size_t i=0; i < pfs->particles_size; i++)
+    {
+        cx = grid->particle_cell[i] % grid->cells_x;
+        cy = grid->particle_cell[i] / grid->cells_x;
+
+        for (size_t y=(cy > 0 ? cy - 1 : 0); y <= cy + 1 && y < grid->cells_y; y++)
+            for (size_t x=(cx > 0 ? cx - 1 : 0); x <= cx + 1 && x < grid->cells_x; x++)
+            {
+                cell = x + y * grid->cells_x;
+                for (size_t k=grid->cell_start[cell]; k < grid->cell_start[cell + 1]; k++)
+                {
+                    j = grid->cell_particles[k];
+                    if (j > i)
+                        pair(pfs, i, j, data);
+                }
+            }
+    }
+}
+
+static int contact_compare(const void *a, const void *b)
+{
+    const PFS_contact_t *c0 = (const PFS_contact_t *)a;
+    const PFS_contact_t *c1 = (const PFS_contact_t *)b;
+
+    if (c0->a != c1->a)
+        return (c0->a < c1->a) ? -1 : 1;
+    if (c0->wall != c1->wall)
+        return c0->wall ? 1 : -1;
+    if (c0->b != c1->b)
+        return (c0->b < c1->b) ? -1 : 1;
+    return 0;
+}
+
+// Restitution target of a contact assuming it is new, contact_match drops it
+// again for contacts that persist from the previous substep.
+static float contact_restitution(PFS_t *pfs, float approach)
+{
+    return (approach < -pfs->state->contact_bounce_threshold) ? -pfs->state->e * approach : 0.0f;
+}
+
+// Normal velocity of the contact, negative while it closes. Walls are the
+// first body of their contacts, so the particle moves along the normal.
+static float contact_approach(PFS_t *pfs, PFS_contact_t *contact)
+{
+    PFS_particle_t *p0 = &pfs->particles_array[contact->a];
     PFS_particle_t *p1;
     PFS_wall_t *wall;
 
-    for (size_t i=0; i < pfs->particles_size; i++)    
+    if (contact->wall)
     {
-        p0 = &pfs->particles_array[i];
+        wall = &pfs->walls_array[contact->b];
+        return (p0->vel_x - wall->vel_x) * contact->normal_x + (p0->vel_y - wall->vel_y) * contact->normal_y;
+    }
 
-        // Handle collision between particles.
-        for (size_t j=i+1; j < pfs->particles_size; j++)
-        {
-            p1 = &pfs->particles_array[j];
-            collide_particles(pfs->state->e, pfs->state->particle_radius, p0, p1);
-        }
+    p1 = &pfs->particles_array[contact->b];
+    return (p1->vel_x - p0->vel_x) * contact->normal_x + (p1->vel_y - p0->vel_y) * contact->normal_y;
+}
 
-        // Handle collision between particle and wall.
-        for (size_t k=0; k < pfs->walls_size; k++)
-        {
-            wall = &pfs->walls_array[k];
-            collide_particle_wall(pfs->state->e, pfs->state->particle_radius, p0, wall);
-        }
+// Walls are kinematic, only the particle takes the impulse.
+static float contact_inverse_mass(PFS_contact_t *contact)
+{
+    return contact->wall ? 1.0f : 2.0f;
+}
+
+static void contact_apply(PFS_t *pfs, PFS_contact_t *contact, float impulse)
+{
+    PFS_particle_t *p0 = &pfs->particles_array[contact->a];
+    PFS_particle_t *p1;
+
+    if (contact->wall)
+    {
+        p0->vel_x += contact->normal_x * impulse;
+        p0->vel_y += contact->normal_y * impulse;
+        return;
     }
+
+    p1 = &pfs->particles_array[contact->b];
+    p0->vel_x -= contact->normal_x * impulse;
+    p0->vel_y -= contact->normal_y * impulse;
+    p1->vel_x += contact->normal_x * impulse;
+    p1->vel_y += contact->normal_y * impulse;
 }
 
-void pfs_close(PFS_t *pfs)
+static void contact_move(PFS_t *pfs, PFS_contact_t *contact, float distance)
 {
-    free(pfs->particles_array);
+    PFS_particle_t *p0 = &pfs->particles_array[contact->a];
+    PFS_particle_t *p1;
+
+    if (contact->wall)
+    {
+        p0->x += contact->normal_x * distance;
+        p0->y += contact->normal_y * distance;
+        return;
+    }
+
+    p1 = &pfs->particles_array[contact->b];
+    p0->x -= contact->normal_x * distance;
+    p0->y -= contact->normal_y * distance;
+    p1->x += contact->normal_x * distance;
+    p1->y += contact->normal_y * distance;
+}
+
+static void contact_test(PFS_t *pfs, size_t i, size_t j, void *data)
+{
+    PFS_particle_t *p0 = &pfs->particles_array[i];
+    PFS_particle_t *p1 = &pfs->particles_array[j];
+    PFS_contact_t contact;
+    float radius = pfs->state->particle_radius;
+    float dist_x = p1->x - p0->x;
+    float dist_y = p1->y - p0->y;
+    float dist;
+    (void)data;
+
+    if (dist_x * dist_x + dist_y * dist_y >= radius * radius)
+        return;
+
+    dist = sqrt(dist_x * dist_x + dist_y * dist_y);
+    contact.a = i;
+    contact.b = j;
+    contact.wall = false;
+    contact.normal_x = (dist > 0.0f) ? dist_x / dist : 1.0f;
+    contact.normal_y = (dist > 0.0f) ? dist_y / dist : 0.0f;
+    contact.impulse = 0.0f;
+    contact.bounce = 0.0f;
+    contact.target = contact_restitution(pfs, contact_approach(pfs, &contact));
+    contact_push(&pfs->internal->contact_solver, contact);
+}
+
+static void contact_test_walls(PFS_t *pfs, size_t i)
+{
+    PFS_contact_t contact;
+    float depth;
+
+    for (size_t k=0; k < pfs->walls_size; k++)
+    {
+        if (!wall_contact(pfs->state->particle_radius, &pfs->particles_array[i], &pfs->walls_array[k],
+                    &contact.normal_x, &contact.normal_y, &depth))
+            continue;
+
+        contact.a = i;
+        contact.b = k;
+        contact.wall = true;
+        contact.impulse = 0.0f;
+        contact.bounce = 0.0f;
+        contact.target = contact_restitution(pfs, contact_approach(pfs, &contact));
+        contact_push(&pfs->internal->contact_solver, contact);
+    }
+}
+
+static void contact_build(PFS_t *pfs)
+{
+    PFS_contact_solver_t *cs = &pfs->internal->contact_solver;
+
+    cs->contacts_size = 0;
+    if (pfs->state->broadphase == PFS_BROADPHASE_GRID)
+    {
+        grid_build(pfs, pfs->state->particle_radius);
+        grid_for_each_pair(pfs, contact_test, NULL);
+    }
+    else
+    {
+        for (size_t i=0; i < pfs->particles_size; i++)
+            for (size_t j=i+1; j < pfs->particles_size; j++)
+                contact_test(pfs, i, j, NULL);
+    }
+
+    for (size_t i=0; i < pfs->particles_size; i++)
+        contact_test_walls(pfs, i);
+
+    // Contacts must end up sorted, which contact_match relies on.
+    if (cs->contacts_size > 0)
+        qsort(cs->contacts, cs->contacts_size, sizeof(PFS_contact_t), contact_compare);
+}
+
+// Matches the contacts against the previous substep. Persisting contacts are
+// resting or sliding, so they lose their restitution target, which only new
+// impacts get, and start from the previous non-restitution impulse.
+static void contact_match(PFS_t *pfs)
+{
+    PFS_contact_solver_t *cs = &pfs->internal->contact_solver;
+    PFS_contact_t *contact;
+    PFS_contact_t *previous;
+    size_t k = 0;
+
+    for (size_t c=0; c < cs->contacts_size; c++)
+    {
+        contact = &cs->contacts[c];
+
+        while (k < cs->previous_size && contact_compare(&cs->previous[k], contact) < 0)
+            k++;
+
+        if (k == cs->previous_size)
+            break;
+
+        previous = &cs->previous[k];
+        if (contact_compare(previous, contact) != 0)
+            continue;
+
+        contact->target = 0.0f;
+        if (pfs->state->contact_warm_start <= 0.0f)
+            continue;
+
+        contact->impulse = previous->impulse * pfs->state->contact_warm_start;
+        contact_apply(pfs, contact, contact->impulse);
+    }
+}
+
+// Non-penetration: the accumulated impulse only ever pushes and stops the
+// contact from closing, it never adds energy.
+static float contact_velocity_delta(PFS_t *pfs, PFS_contact_t *contact, float relaxation)
+{
+    float approach = contact_approach(pfs, contact);
+    float impulse = fmax(contact->impulse - relaxation * approach / contact_inverse_mass(contact), 0.0f);
+    float delta = impulse - contact->impulse;
 
-    if (pfs->walls_capacity > 0)
-        free(pfs->walls_array);
+    contact->impulse = impulse;
+    return delta;
 }
 
+// Restitution runs once after the non-penetration iterations and only for new
+// impacts, so it bounces them at most back to their approach speed.
+static float contact_bounce_delta(PFS_t *pfs, PFS_contact_t *contact, float relaxation)
+{
+    float total = contact->impulse + contact->bounce;
+    float bounced;
+    float delta;
+
+    if (contact->target <= 0.0f)
+        return 0.0f;
+
+    bounced = fmax(total + relaxation * (contact->target - contact_approach(pfs, contact)) / contact_inverse_mass(contact), 0.0f);
+    delta = bounced - total;
+    contact->bounce += delta;
+    return delta;
+}
+
+// Positions only, the projection never feeds back into the velocities.
+static float contact_position_delta(PFS_t *pfs, PFS_contact_t *contact, float relaxation)
+{
+    PFS_particle_t *p0 = &pfs->particles_array[contact->a];
+    PFS_particle_t *p1;
+    float radius = pfs->state->particle_radius;
+    float dist_x;
+    float dist_y;
+    float dist;
+    float depth;
+
+    // A small slop keeps resting contacts from jittering in and out.
+    if (contact->wall)
+    {
+        if (!wall_contact(radius, p0, &pfs->walls_array[contact->b], &contact->normal_x, &contact->normal_y, &depth))
+            return 0.0f;
+        return relaxation * fmax(depth - PFS_CONTACT_SLOP * radius, 0.0f);
+    }
+
+    p1 = &pfs->particles_array[contact->b];
+    dist_x = p1->x - p0->x;
+    dist_y = p1->y - p0->y;
+    dist = sqrt(dist_x * dist_x + dist_y * dist_y);
+    if (dist > 0.0f)
+    {
+        contact->normal_x = dist_x / dist;
+        contact->normal_y = dist_y / dist;
+    }
+
+    return relaxation * fmax(radius - dist - PFS_CONTACT_SLOP * radius, 0.0f) / 2.0f;
+}
+
+static void contact_solve_gauss_seidel(PFS_t *pfs)
+{
+    PFS_contact_solver_t *cs = &pfs->internal->contact_solver;
+    float relaxation = pfs->state->contact_relaxation;
+
+    for (int it=0; it < pfs->state->contact_iterations; it++)
+        for (size_t c=0; c < cs->contacts_size; c++)
+            contact_apply(pfs, &cs->contacts[c], contact_velocity_delta(pfs, &cs->contacts[c], relaxation));
+
+    for (int it=0; it < pfs->state->contact_iterations; it++)
+        for (size_t c=0; c < cs->contacts_size; c++)
+            contact_apply(pfs, &cs->contacts[c], contact_bounce_delta(pfs, &cs->contacts[c], relaxation));
+
+    for (int it=0; it < pfs->state->contact_iterations; it++)
+        for (size_t c=0; c < cs->contacts_size; c++)
+            contact_move(pfs, &cs->contacts[c], contact_position_delta(pfs, &cs->contacts[c], relaxation));
+}
+
+// A particle with n contacts gets n corrections per Jacobi iteration, so each
+// contact only applies its share of the relaxation.
+static float contact_share(PFS_contact_solver_t *cs, PFS_contact_t *contact, float relaxation)
+{
+    unsigned int count = cs->counts[contact->a];
+
+    if (!contact->wall && cs->counts[contact->b] > count)
+        count = cs->counts[contact->b];
+    return relaxation / count;
+}
+
+static void contact_solve_jacobi(PFS_t *pfs)
+{
+    PFS_contact_solver_t *cs = &pfs->internal->contact_solver;
+    PFS_contact_t *contact;
+    float relaxation = pfs->state->contact_relaxation;
+
+    if (cs->deltas_capacity < cs->contacts_size)
+    {
+        cs->deltas_capacity = cs->contacts_capacity;
+        cs->deltas = (float *)realloc(cs->deltas, sizeof(float) * cs->deltas_capacity);
+    }
+    if (cs->counts_capacity < pfs->particles_capacity)
+    {
+        cs->counts_capacity = pfs->particles_capacity;
+        cs->counts = (unsigned int *)realloc(cs->counts, sizeof(unsigned int) * cs->counts_capacity);
+    }
+
+    memset(cs->counts, 0, sizeof(unsigned int) * pfs->particles_size);
+    for (size_t c=0; c < cs->contacts_size; c++)
+    {
+        contact = &cs->contacts[c];
+        cs->counts[contact->a]++;
+        if (!contact->wall)
+            cs->counts[contact->b]++;
+    }
+
+    // Every contact reads the state of the previous iteration, so the delta
+    // pass is independent per contact and only the scatter is sequential.
+    for (int it=0; it < pfs->state->contact_iterations; it++)
+    {
+        #ifdef _OPENMP
+        #pragma omp parallel for
+        #endif
+        for (size_t c=0; c < cs->contacts_size; c++)
+            cs->deltas[c] = contact_velocity_delta(pfs, &cs->contacts[c], contact_share(cs, &cs->contacts[c], relaxation));
+
+        for (size_t c=0; c < cs->contacts_size; c++)
+            contact_apply(pfs, &cs->contacts[c], cs->deltas[c]);
+    }
+
+    for (int it=0; it < pfs->state->contact_iterations; it++)
+    {
+        #ifdef _OPENMP
+        #pragma omp parallel for
+        #endif
+        for (size_t c=0; c < cs->contacts_size; c++)
+            cs->deltas[c] = contact_bounce_delta(pfs, &cs->contacts[c], contact_share(cs, &cs->contacts[c], relaxation));
+
+        for (size_t c=0; c < cs->contacts_size; c++)
+            contact_apply(pfs, &cs->contacts[c], cs->deltas[c]);
+    }
+
+    for (int it=0; it < pfs->state->contact_iterations; it++)
+    {
+        #ifdef _OPENMP
+        #pragma omp parallel for
+        #endif
+        for (size_t c=0; c < cs->contacts_size; c++)
+            cs->deltas[c] = contact_position_delta(pfs, &cs->contacts[c], contact_share(cs, &cs->contacts[c], relaxation));
+
+        for (size_t c=0; c < cs->contacts_size; c++)
+            contact_move(pfs, &cs->contacts[c], cs->deltas[c]);
+    }
+}
+
+static void respawn_particle(PFS_t *pfs, PFS_particle_t *particle)
+{
+    float random_angle = ((float)rand() / RAND_MAX) * 2.0f * M_PI;
+    particle->vel_x = cos(random_angle) * pfs->state->start_velocity_magnitude;
+    particle->vel_y = -sin(random_angle) * pfs->state->start_velocity_magnitude;
+
+    bool intersect = true;
+    while (intersect)
+    {
+        particle->x = pfs->state->space_width * (float)rand() / RAND_MAX;
+        particle->y = pfs->state->space_height * (float)rand() / RAND_MAX;
+
+        intersect = false;
+        for (size_t i=0; i < pfs->walls_size; i++)
+        {
+            PFS_wall_t *wall = &pfs->walls_array[i];
+            intersect = wall->x < particle->x && particle->x < wall->x + wall->width &&
+                        wall->y < particle->y && particle->y < wall->y + wall->height;
+            if (intersect)
+                break;
+        }
+    }
+}
+
+static void event_push(PFS_event_solver_t *es, PFS_event_t event)
+{
+    if (es->heap_size == es->heap_capacity)
+    {
+        es->heap_capacity = (es->heap_capacity == 0) ? 1024 : es->heap_capacity * 2;
+        es->heap = (PFS_event_t *)realloc(es->heap, sizeof(PFS_event_t) * es->heap_capacity);
+    }
+
+    size_t i = es->heap_size++;
+    while (i > 0)
+    {
+        size_t parent = (i - 1) / 2;
+        if (es->heap[parent].time <= event.time)
+            break;
+        es->heap[i] = es->heap[parent];
+        i = parent;
+    }
+    es->heap[i] = event;
+}
+
+static PFS_event_t event_pop(PFS_event_solver_t *es)
+{
+    PFS_event_t top = es->heap[0];
+    PFS_event_t last = es->heap[--es->heap_size];
+    size_t i = 0;
+    size_t child;
+
+    while ((child = 2 * i + 1) < es->heap_size)
+    {
+        if (child + 1 < es->heap_size && es->heap[child + 1].time < es->heap[child].time)
+            child++;
+        if (last.time <= es->heap[child].time)
+            break;
+        es->heap[i] = es->heap[child];
+        i = child;
+    }
+    if (es->heap_size > 0)
+        es->heap[i] = last;
+
+    return top;
+}
+
+static void event_cell_insert(PFS_event_solver_t *es, size_t i, size_t cell)
+{
+    es->cell_of[i] = cell;
+    es->cell_prev[i] = PFS_NONE;
+    es->cell_next[i] = es->cell_head[cell];
+    if (es->cell_head[cell] != PFS_NONE)
+        es->cell_prev[es->cell_head[cell]] = i;
+    es->cell_head[cell] = i;
+}
+
+static void event_cell_remove(PFS_event_solver_t *es, size_t i)
+{
+    if (es->cell_prev[i] != PFS_NONE)
+        es->cell_next[es->cell_prev[i]] = es->cell_next[i];
+    else
+        es->cell_head[es->cell_of[i]] = es->cell_next[i];
+
+    if (es->cell_next[i] != PFS_NONE)
+        es->cell_prev[es->cell_next[i]] = es->cell_prev[i];
+}
+
+static void event_advance_particle(PFS_t *pfs, size_t i, float time)
+{
+    PFS_particle_t *p = &pfs->particles_array[i];
+    float elapsed = time - pfs->internal->event_solver.times[i];
+
+    p->x += p->vel_x * elapsed;
+    p->y += (p->vel_y + 0.5f * pfs->state->g * elapsed) * elapsed;
+    p->vel_y += pfs->state->g * elapsed;
+    pfs->internal->event_solver.times[i] = time;
+}
+
+static void event_predict(PFS_t *pfs, size_t i, float now, float end)
+{
+    PFS_event_solver_t *es = &pfs->internal->event_solver;
+    PFS_particle_t *p = &pfs->particles_array[i];
+    PFS_particle_t *q;
+    PFS_wall_t wall;
+    PFS_event_t event;
+    float radius = pfs->state->particle_radius;
+    float g = pfs->state->g;
+    float toi;
+    float normal_x;
+    float normal_y;
+
+    size_t cell_x = es->cell_of[i] % es->cells_x;
+    size_t cell_y = es->cell_of[i] / es->cells_x;
+
+    event.a = i;
+    event.count_a = es->counts[i];
+
+    // Particle-particle events with the neighbouring cells. Gravity moves both
+    // alike, so relative to each other they still travel in straight lines.
+    for (size_t y = (cell_y > 0) ? cell_y - 1 : 0; y <= cell_y + 1 && y < es->cells_y; y++)
+        for (size_t x = (cell_x > 0) ? cell_x - 1 : 0; x <= cell_x + 1 && x < es->cells_x; x++)
+            for (size_t j = es->cell_head[x + y * es->cells_x]; j != PFS_NONE; j = es->cell_next[j])
+            {
+                if (j == i)
+                    continue;
+
+                q = &pfs->particles_array[j];
+                float elapsed = now - es->times[j];
+                if (!time_of_impact_circle(
+                            q->x + q->vel_x * elapsed - p->x, q->y + (q->vel_y + 0.5f * g * elapsed) * elapsed - p->y,
+                            q->vel_x - p->vel_x, q->vel_y + g * elapsed - p->vel_y,
+                            radius, end - now, &toi))
+                    continue;
+
+                event.time = now + toi;
+                event.type = PFS_EVENT_PARTICLE;
+                event.b = j;
+                event.count_b = es->counts[j];
+                event_push(es, event);
+            }
+
+    // Particle-wall events, walls move linearly and particles on parabolas.
+    for (size_t k=0; k < pfs->walls_size; k++)
+    {
+        wall = pfs->walls_array[k];
+        wall.x += wall.vel_x * now;
+        wall.y += wall.vel_y * now;
+
+        if (sweep_particle_wall(radius, end - now, g, p, &wall, &toi, &normal_x, &normal_y) != 1)
+            continue;
+
+        event.time = now + toi;
+        event.type = PFS_EVENT_WALL;
+        event.b = k;
+        event.count_b = 0;
+        event.normal_x = normal_x;
+        event.normal_y = normal_y;
+        event_push(es, event);
+    }
+
+    // Cell crossing event, border cells extend to infinity. A particle
+    // thrown upwards can fall back out of the cell it is rising through.
+    float cross_x = INFINITY;
+    float cross_y = INFINITY;
+    float cross;
+    size_t next_x = cell_x;
+    size_t next_y = cell_y;
+
+    if (cell_x + 1 < es->cells_x && (cross = crossing_time(p->x, p->vel_x, 0.0f, (cell_x + 1) * es->cell_size, 1.0f)) < cross_x)
+    {
+        cross_x = cross;
+        next_x = cell_x + 1;
+    }
+    if (cell_x > 0 && (cross = crossing_time(p->x, p->vel_x, 0.0f, cell_x * es->cell_size, -1.0f)) < cross_x)
+    {
+        cross_x = cross;
+        next_x = cell_x - 1;
+    }
+
+    if (cell_y + 1 < es->cells_y && (cross = crossing_time(p->y, p->vel_y, g, (cell_y + 1) * es->cell_size, 1.0f)) < cross_y)
+    {
+        cross_y = cross;
+        next_y = cell_y + 1;
+    }
+    if (cell_y > 0 && (cross = crossing_time(p->y, p->vel_y, g, cell_y * es->cell_size, -1.0f)) < cross_y)
+    {
+        cross_y = cross;
+        next_y = cell_y - 1;
+    }
+
+    if (cross_x <= cross_y && now + cross_x <= end)
+    {
+        event.time = now + fmax(cross_x, 0.0f);
+        event.b = next_x + cell_y * es->cells_x;
+    } else if (cross_y < cross_x && now + cross_y <= end)
+    {
+        event.time = now + fmax(cross_y, 0.0f);
+        event.b = cell_x + next_y * es->cells_x;
+    } else
+        return;
+
+    event.type = PFS_EVENT_CELL;
+    event.count_b = 0;
+    event_push(es, event);
+}
+
+static void event_solver_reserve(PFS_t *pfs)
+{
+    PFS_event_solver_t *es = &pfs->internal->event_solver;
+    PFS_state_t *state = pfs->state;
+    size_t n = pfs->particles_size;
+
+    // Roughly one particle per cell, never smaller than the contact distance.
+    es->cell_size = fmax(state->particle_radius, sqrt(state->space_width * state->space_height / (float)(n > 0 ? n : 1)));
+    es->cells_x = (size_t)fmax(1.0f, state->space_width / es->cell_size);
+    es->cells_y = (size_t)fmax(1.0f, state->space_height / es->cell_size);
+
+    // Sized to the pool so emitters never force a reallocation here.
+    if (es->particles_capacity < pfs->particles_capacity)
+    {
+        es->particles_capacity = pfs->particles_capacity;
+        es->times = (float *)realloc(es->times, sizeof(float) * es->particles_capacity);
+        es->counts = (unsigned int *)realloc(es->counts, sizeof(unsigned int) * es->particles_capacity);
+        es->cell_of = (size_t *)realloc(es->cell_of, sizeof(size_t) * es->particles_capacity);
+        es->cell_next = (size_t *)realloc(es->cell_next, sizeof(size_t) * es->particles_capacity);
+        es->cell_prev = (size_t *)realloc(es->cell_prev, sizeof(size_t) * es->particles_capacity);
+    }
+
+    if (es->cells_capacity < es->cells_x * es->cells_y)
+    {
+        es->cells_capacity = es->cells_x * es->cells_y;
+        es->cell_head = (size_t *)realloc(es->cell_head, sizeof(size_t) * es->cells_capacity);
+    }
+}
+
+// The version the library was built as, to check against PFS_VERSION when
+// linking against a shared build.
+int pfs_version(void)
+{
+    return PFS_VERSION;
+}
+
+PFS_state_t pfs_state_default(void)
+{
+    PFS_state_t state;
+
+    state.pixel_to_meter = 0.0001f;
+    state.space_width = 0.01f;
+    state.space_height = 0.03f;
+    state.particle_radius = 1.0f * state.pixel_to_meter;
+    state.time_speed = 0.005f;
+    state.start_velocity_magnitude = 0.9f;
+    state.e = 1.0f;
+    state.g = 9.8066f;
+    state.solver = PFS_SOLVER_TIME_STEPPED;
+    state.broadphase = PFS_BROADPHASE_GRID;
+    state.open_boundaries = false;
+    state.contact_solver = PFS_CONTACT_GAUSS_SEIDEL;
+    state.contact_iterations = 4;
+    state.contact_relaxation = 1.0f;
+    state.contact_warm_start = 0.8f;
+    state.contact_bounce_threshold = 0.01f;
+
+    return state;
+}
+
+void pfs_create(PFS_t *pfs, PFS_state_t *state, size_t particles_size)
+{
+    srand(time(0));
+    pfs->state = state;
+    pfs->particles_size = particles_size;
+    pfs->particles_capacity = particles_size;
+    pfs->walls_size = 0;
+    pfs->walls_capacity = 0;
+    pfs->emitters_size = 0;
+    pfs->emitters_capacity = 0;
+    pfs->sinks_size = 0;
+    pfs->sinks_capacity = 0;
+    pfs->particles_array = (PFS_particle_t *)malloc(sizeof(PFS_particle_t) * particles_size);
+    pfs->walls_array = NULL;
+    pfs->emitters_array = NULL;
+    pfs->sinks_array = NULL;
+    pfs->internal = (PFS_internal_t *)calloc(1, sizeof(PFS_internal_t));
+}
+
+void pfs_start_random(PFS_t *pfs)
+{
+    float random_angle;
+    PFS_particle_t *particle;
+
+    for (size_t i=0; i < pfs->particles_size; i++)
+    {
+        particle = &pfs->particles_array[i];
+
+        random_angle = ((float)rand() / RAND_MAX) * 2.0f * M_PI;
+        particle->vel_x = cos(random_angle) * pfs->state->start_velocity_magnitude;
+        particle->vel_y = -sin(random_angle) * pfs->state->start_velocity_magnitude;
+        particle->x = ((float)rand() / RAND_MAX) * pfs->state->space_width; 
+        particle->y = ((float)rand() / RAND_MAX) * pfs->state->space_height; 
+    }
+}
+
+void pfs_add_wall(PFS_t *pfs, float x, float y, float width, float height)
+{
+    if (pfs->walls_size == pfs->walls_capacity)
+    {
+        pfs->walls_capacity = (pfs->walls_capacity == 0) ? 2 : pfs->walls_capacity * 2;
+        pfs->walls_array = (PFS_wall_t *)realloc(pfs->walls_array, sizeof(PFS_wall_t) * pfs->walls_capacity);
+    }
+
+    pfs->walls_array[pfs->walls_size].x = x;
+    pfs->walls_array[pfs->walls_size].y = y;
+    pfs->walls_array[pfs->walls_size].width = width;
+    pfs->walls_array[pfs->walls_size].height = height;
+    pfs->walls_array[pfs->walls_size].vel_x = 0.0f;
+    pfs->walls_array[pfs->walls_size].vel_y = 0.0f;
+    pfs->walls_size++;
+}
+
+void pfs_add_emitter(PFS_t *pfs, float x, float y, float width, float height, float rate, float vel_x, float vel_y)
+{
+    if (pfs->emitters_size == pfs->emitters_capacity)
+    {
+        pfs->emitters_capacity = (pfs->emitters_capacity == 0) ? 2 : pfs->emitters_capacity * 2;
+        pfs->emitters_array = (PFS_emitter_t *)realloc(pfs->emitters_array, sizeof(PFS_emitter_t) * pfs->emitters_capacity);
+    }
+
+    pfs->emitters_array[pfs->emitters_size].x = x;
+    pfs->emitters_array[pfs->emitters_size].y = y;
+    pfs->emitters_array[pfs->emitters_size].width = width;
+    pfs->emitters_array[pfs->emitters_size].height = height;
+    pfs->emitters_array[pfs->emitters_size].rate = rate;
+    pfs->emitters_array[pfs->emitters_size].vel_x = vel_x;
+    pfs->emitters_array[pfs->emitters_size].vel_y = vel_y;
+    pfs->emitters_array[pfs->emitters_size].accumulator = 0.0f;
+    pfs->emitters_size++;
+}
+
+void pfs_add_sink(PFS_t *pfs, float x, float y, float width, float height)
+{
+    if (pfs->sinks_size == pfs->sinks_capacity)
+    {
+        pfs->sinks_capacity = (pfs->sinks_capacity == 0) ? 2 : pfs->sinks_capacity * 2;
+        pfs->sinks_array = (PFS_sink_t *)realloc(pfs->sinks_array, sizeof(PFS_sink_t) * pfs->sinks_capacity);
+    }
+
+    pfs->sinks_array[pfs->sinks_size].x = x;
+    pfs->sinks_array[pfs->sinks_size].y = y;
+    pfs->sinks_array[pfs->sinks_size].width = width;
+    pfs->sinks_array[pfs->sinks_size].height = height;
+    pfs->sinks_size++;
+}
+
+void pfs_reserve(PFS_t *pfs, size_t capacity)
+{
+    if (capacity <= pfs->particles_capacity)
+        return;
+
+    pfs->particles_capacity = capacity;
+    pfs->particles_array = (PFS_particle_t *)realloc(pfs->particles_array, sizeof(PFS_particle_t) * capacity);
+}
+
+void pfs_update_sources(PFS_t *pfs, float delta_time)
+{
+    float real_delta_time = delta_time * pfs->state->time_speed;
+    PFS_particle_t *particle;
+    PFS_emitter_t *emitter;
+    PFS_sink_t *sink;
+    size_t removed = 0;
+    bool remove;
+
+    // The pool is kept dense by moving the last active particle into the
+    // freed slot, so the solvers never see dead particles.
+    if (pfs->sinks_size > 0 || pfs->state->open_boundaries)
+    {
+        for (size_t i=0; i < pfs->particles_size;)
+        {
+            particle = &pfs->particles_array[i];
+            remove = pfs->state->open_boundaries &&
+                     (particle->x < 0 || pfs->state->space_width < particle->x || particle->y < 0 || pfs->state->space_height < particle->y);
+
+            for (size_t k=0; k < pfs->sinks_size && !remove; k++)
+            {
+                sink = &pfs->sinks_array[k];
+                remove = sink->x <= particle->x && particle->x <= sink->x + sink->width &&
+                         sink->y <= particle->y && particle->y <= sink->y + sink->height;
+            }
+
+            if (!remove)
+            {
+                i++;
+                continue;
+            }
+
+            *particle = pfs->particles_array[--pfs->particles_size];
+            removed++;
+        }
+    }
+
+    // Swapped particles no longer match the previous contact indices.
+    if (removed > 0)
+        pfs->internal->contact_solver.previous_size = 0;
+
+    for (size_t k=0; k < pfs->emitters_size; k++)
+    {
+        emitter = &pfs->emitters_array[k];
+        emitter->accumulator += emitter->rate * real_delta_time;
+
+        while (emitter->accumulator >= 1.0f && pfs->particles_size < pfs->particles_capacity)
+        {
+            particle = &pfs->particles_array[pfs->particles_size++];
+            particle->x = emitter->x + emitter->width * (float)rand() / RAND_MAX;
+            particle->y = emitter->y + emitter->height * (float)rand() / RAND_MAX;
+            particle->vel_x = emitter->vel_x;
+            particle->vel_y = emitter->vel_y;
+            emitter->accumulator -= 1.0f;
+        }
+
+        // A full pool drops the backlog instead of bursting once slots free up.
+        if (pfs->particles_size == pfs->particles_capacity)
+            emitter->accumulator = fmin(emitter->accumulator, 1.0f);
+    }
+}
+
+void pfs_update_particle(PFS_t *pfs, PFS_particle_t *particle, float delta_time)
+{
+    float real_delta_time = delta_time * pfs->state->time_speed;
+    //int border;
+
+    particle->x += particle->vel_x * real_delta_time;
+    particle->y += particle->vel_y * real_delta_time;
+    particle->vel_y += pfs->state->g * real_delta_time; 
+
+    if (!pfs->state->open_boundaries &&
+            (particle->x < 0 || pfs->state->space_width < particle->x || particle->y < 0 || pfs->state->space_height < particle->y))
+    {
+        respawn_particle(pfs, particle);
+
+       /*border = rand() % 2;
+
+        switch (border)
+        {
+            case 0:
+                particle->x = 0;
+                particle->y = ((float)rand() / RAND_MAX) * pfs->state->space_height;
+                break;
+
+            case 1:
+                particle->x = pfs->state->space_width;
+                particle->y = ((float)rand() / RAND_MAX) * pfs->state->space_height;
+                break;
+
+            default:
+                break;
+        }*/
+
+        /*border = rand() % 4;
+
+        switch (border)
+        {
+            case 0:
+                particle->x = ((float)rand() / RAND_MAX) * pfs->state->space_width;
+                particle->y = 0;
+                break;
+
+            case 1:
+                particle->x = 0;
+                particle->y = ((float)rand() / RAND_MAX) * pfs->state->space_height;
+                break;
+
+            case 2:
+                particle->x = ((float)rand() / RAND_MAX) * pfs->state->space_width;
+                particle->y = pfs->state->space_height;
+                break;
+
+            case 3:
+                particle->x = pfs->state->space_width;
+                particle->y = ((float)rand() / RAND_MAX) * pfs->state->space_height;
+                break;
+
+            default:
+                break;
+        }*/
+    }
+}
+
+void pfs_handle_collisions(PFS_t *pfs)
+{
+    PFS_contact_solver_t *cs = &pfs->internal->contact_solver;
+    PFS_contact_t *temp_contacts;
+    size_t temp_capacity;
+
+    // Particle and wall contacts are solved together.
+    contact_build(pfs);
+    contact_match(pfs);
+
+    if (pfs->state->contact_solver == PFS_CONTACT_JACOBI)
+        contact_solve_jacobi(pfs);
+    else
+        contact_solve_gauss_seidel(pfs);
+
+    // Keep this substep's impulses around to warm start the next one.
+    temp_contacts = cs->previous;
+    temp_capacity = cs->previous_capacity;
+    cs->previous = cs->contacts;
+    cs->previous_size = cs->contacts_size;
+    cs->previous_capacity = cs->contacts_capacity;
+    cs->contacts = temp_contacts;
+    cs->contacts_size = 0;
+    cs->contacts_capacity = temp_capacity;
+}
+
+static void sweep_pair(PFS_t *pfs, size_t i, size_t j, void *data)
+{
+    PFS_particle_t *p0 = &pfs->particles_array[i];
+    PFS_particle_t *p1 = &pfs->particles_array[j];
+    float real_delta_time = *(float *)data;
+    float e = pfs->state->e;
+    float toi;
+    float normal_x;
+    float normal_y;
+    float magnitude;
+    float imp;
+
+    if (!sweep_particles(pfs->state->particle_radius, real_delta_time, p0, p1, &toi))
+        return;
+
+    normal_x = (p1->x + p1->vel_x * toi) - (p0->x + p0->vel_x * toi);
+    normal_y = (p1->y + p1->vel_y * toi) - (p0->y + p0->vel_y * toi);
+    magnitude = sqrt(normal_x * normal_x + normal_y * normal_y);
+    if (magnitude == 0.0f)
+        return;
+    normal_x /= magnitude;
+    normal_y /= magnitude;
+
+    imp = -(1.0f + e) * ((p0->vel_x - p1->vel_x) * normal_x + (p0->vel_y - p1->vel_y) * normal_y) / 2.0f;
+
+    p0->vel_x += normal_x * imp;
+    p0->vel_y += normal_y * imp;
+    p1->vel_x -= normal_x * imp;
+    p1->vel_y -= normal_y * imp;
+
+    p0->x -= normal_x * imp * toi;
+    p0->y -= normal_y * imp * toi;
+    p1->x += normal_x * imp * toi;
+    p1->y += normal_y * imp * toi;
+}
+
+static void sweep_short_pair(PFS_t *pfs, size_t i, size_t j, void *data)
+{
+    if (!pfs->internal->grid.long_sweep[i] && !pfs->internal->grid.long_sweep[j])
+        sweep_pair(pfs, i, j, data);
+}
+
+// Tests a long sweep against every short one in the cells its swept box
+// covers, grown by the furthest a short sweep can come towards it.
+static void sweep_long(PFS_t *pfs, size_t i, float reach, float *real_delta_time)
+{
+    PFS_grid_t *grid = &pfs->internal->grid;
+    PFS_particle_t *p = &pfs->particles_array[i];
+    float grow = pfs->state->particle_radius + reach;
+    size_t min_x = cell_coord(fmin(p->x, p->x + p->vel_x * *real_delta_time) - grow, grid->cell_size, grid->cells_x);
+    size_t max_x = cell_coord(fmax(p->x, p->x + p->vel_x * *real_delta_time) + grow, grid->cell_size, grid->cells_x);
+    size_t min_y = cell_coord(fmin(p->y, p->y + p->vel_y * *real_delta_time) - grow, grid->cell_size, grid->cells_y);
+    size_t max_y = cell_coord(fmax(p->y, p->y + p->vel_y * *real_delta_time) + grow, grid->cell_size, grid->cells_y);
+    size_t cell;
+    size_t j;
+
+    for (size_t y=min_y; y <= max_y; y++)
+        for (size_t x=min_x; x <= max_x; x++)
+        {
+            cell = x + y * grid->cells_x;
+            for (size_t k=grid->cell_start[cell]; k < grid->cell_start[cell + 1]; k++)
+            {
+                j = grid->cell_particles[k];
+                if (!grid->long_sweep[j])
+                    sweep_pair(pfs, i, j, real_delta_time);
+            }
+        }
+}
+
+void pfs_handle_collisions_swept(PFS_t *pfs, float delta_time)
+{
+    PFS_particle_t *p0;
+    PFS_wall_t *wall;
+    PFS_grid_t *grid = &pfs->internal->grid;
+    float real_delta_time = delta_time * pfs->state->time_speed;
+    float radius = pfs->state->particle_radius;
+    float e = pfs->state->e;
+    float mean_square = 0.0f;
+    float reach;
+    float toi;
+    float normal_x;
+    float normal_y;
+    float old_vel_x;
+    float old_vel_y;
+    float imp;
+    int hit;
+
+    // Contacts are resolved at their time of impact and the start position is
+    // shifted so that the following pfs_update_particle ends at the right spot.
+    if (pfs->state->broadphase == PFS_BROADPHASE_GRID)
+    {
+        // Two particles can only meet this step if they start within the
+        // radius plus both distances travelled. The cells are sized for twice
+        // the RMS travel so one fast particle does not grow them for all,
+        // the few that sweep further are tested on their own. Pairs pushed
+        // out of reach by earlier impulses are left to pfs_handle_collisions.
+        for (size_t i=0; i < pfs->particles_size; i++)
+        {
+            p0 = &pfs->particles_array[i];
+            mean_square += p0->vel_x * p0->vel_x + p0->vel_y * p0->vel_y;
+        }
+        reach = 2.0f * sqrt(mean_square / (pfs->particles_size > 0 ? pfs->particles_size : 1)) * real_delta_time;
+        grid_build(pfs, radius + 2.0f * reach);
+
+        if (grid->long_sweeps_capacity < pfs->particles_capacity)
+        {
+            grid->long_sweeps_capacity = pfs->particles_capacity;
+            grid->long_sweep = (bool *)realloc(grid->long_sweep, sizeof(bool) * grid->long_sweeps_capacity);
+            grid->long_sweeps = (size_t *)realloc(grid->long_sweeps, sizeof(size_t) * grid->long_sweeps_capacity);
+        }
+        grid->long_sweeps_size = 0;
+        for (size_t i=0; i < pfs->particles_size; i++)
+        {
+            p0 = &pfs->particles_array[i];
+            grid->long_sweep[i] = (p0->vel_x * p0->vel_x + p0->vel_y * p0->vel_y) * real_delta_time * real_delta_time > reach * reach;
+            if (grid->long_sweep[i])
+                grid->long_sweeps[grid->long_sweeps_size++] = i;
+        }
+
+        grid_for_each_pair(pfs, sweep_short_pair, &real_delta_time);
+        for (size_t l=0; l < grid->long_sweeps_size; l++)
+        {
+            sweep_long(pfs, grid->long_sweeps[l], reach, &real_delta_time);
+            for (size_t m=l+1; m < grid->long_sweeps_size; m++)
+                sweep_pair(pfs, grid->long_sweeps[l], grid->long_sweeps[m], &real_delta_time);
+        }
+    }
+    else
+    {
+        for (size_t i=0; i < pfs->particles_size; i++)
+            for (size_t j=i+1; j < pfs->particles_size; j++)
+                sweep_pair(pfs, i, j, &real_delta_time);
+    }
+
+    for (size_t i=0; i < pfs->particles_size; i++)
+    {
+        p0 = &pfs->particles_array[i];
+
+        // Handle collision between particle and wall.
+        for (size_t k=0; k < pfs->walls_size; k++)
+        {
+            wall = &pfs->walls_array[k];
+
+            hit = sweep_particle_wall(radius, real_delta_time, 0.0f, p0, wall, &toi, &normal_x, &normal_y);
+            if (hit == 0)
+                continue;
+
+            // Already overlapping, fall back to the discrete resolution.
+            if (hit < 0)
+            {
+                collide_particle_wall(e, radius, p0, wall);
+                continue;
+            }
+
+            imp = (p0->vel_x - wall->vel_x) * normal_x + (p0->vel_y - wall->vel_y) * normal_y;
+            if (imp >= 0.0f)
+                continue;
+            imp *= -(1.0f + e);
+
+            old_vel_x = p0->vel_x;
+            old_vel_y = p0->vel_y;
+            p0->vel_x += normal_x * imp;
+            p0->vel_y += normal_y * imp;
+            p0->x += (old_vel_x - p0->vel_x) * toi;
+            p0->y += (old_vel_y - p0->vel_y) * toi;
+        }
+    }
+}
+
+void pfs_advance_events(PFS_t *pfs, float delta_time)
+{
+    PFS_event_solver_t *es = &pfs->internal->event_solver;
+    PFS_particle_t *p0;
+    PFS_particle_t *p1;
+    PFS_wall_t *wall;
+    PFS_event_t event;
+    float end = delta_time * pfs->state->time_speed;
+    float e = pfs->state->e;
+    float normal_x;
+    float normal_y;
+    float magnitude;
+    float imp;
+
+    event_solver_reserve(pfs);
+
+    for (size_t c=0; c < es->cells_x * es->cells_y; c++)
+        es->cell_head[c] = PFS_NONE;
+
+    // Overlaps left by teleported walls are resolved discretely before predicting.
+    for (size_t i=0; i < pfs->particles_size; i++)
+    {
+        p0 = &pfs->particles_array[i];
+        for (size_t k=0; k < pfs->walls_size; k++)
+            collide_particle_wall(e, pfs->state->particle_radius, p0, &pfs->walls_array[k]);
+
+        es->times[i] = 0.0f;
+        es->counts[i] = 0;
+        event_cell_insert(es, i,
+                cell_coord(p0->x, es->cell_size, es->cells_x) +
+                cell_coord(p0->y, es->cell_size, es->cells_y) * es->cells_x);
+    }
+
+    es->heap_size = 0;
+    for (size_t i=0; i < pfs->particles_size; i++)
+        event_predict(pfs, i, 0.0f, end);
+
+    while (es->heap_size > 0)
+    {
+        event = event_pop(es);
+
+        // Lazy invalidation, the particles collided since the event was predicted.
+        if (event.count_a != es->counts[event.a])
+            continue;
+        if (event.type == PFS_EVENT_PARTICLE && event.count_b != es->counts[event.b])
+            continue;
+
+        event_advance_particle(pfs, event.a, event.time);
+        p0 = &pfs->particles_array[event.a];
+
+        switch (event.type)
+        {
+            case PFS_EVENT_PARTICLE:
+                event_advance_particle(pfs, event.b, event.time);
+                p1 = &pfs->particles_array[event.b];
+
+                normal_x = p1->x - p0->x;
+                normal_y = p1->y - p0->y;
+                magnitude = sqrt(normal_x * normal_x + normal_y * normal_y);
+                if (magnitude > 0.0f)
+                {
+                    normal_x /= magnitude;
+                    normal_y /= magnitude;
+
+                    imp = -(1.0f + e) * ((p0->vel_x - p1->vel_x) * normal_x + (p0->vel_y - p1->vel_y) * normal_y) / 2.0f;
+                    p0->vel_x += normal_x * imp;
+                    p0->vel_y += normal_y * imp;
+                    p1->vel_x -= normal_x * imp;
+                    p1->vel_y -= normal_y * imp;
+                }
+
+                es->counts[event.a]++;
+                es->counts[event.b]++;
+                event_predict(pfs, event.a, event.time, end);
+                event_predict(pfs, event.b, event.time, end);
+                break;
+
+            case PFS_EVENT_WALL:
+                wall = &pfs->walls_array[event.b];
+                imp = (p0->vel_x - wall->vel_x) * event.normal_x + (p0->vel_y - wall->vel_y) * event.normal_y;
+                if (imp < 0.0f)
+                {
+                    p0->vel_x -= (1.0f + e) * imp * event.normal_x;
+                    p0->vel_y -= (1.0f + e) * imp * event.normal_y;
+                }
+
+                es->counts[event.a]++;
+                event_predict(pfs, event.a, event.time, end);
+                break;
+
+            case PFS_EVENT_CELL:
+                event_cell_remove(es, event.a);
+                event_cell_insert(es, event.a, event.b);
+                es->counts[event.a]++;
+                event_predict(pfs, event.a, event.time, end);
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    for (size_t i=0; i < pfs->particles_size; i++)
+    {
+        event_advance_particle(pfs, i, end);
+        p0 = &pfs->particles_array[i];
+
+        if (!pfs->state->open_boundaries &&
+                (p0->x < 0 || pfs->state->space_width < p0->x || p0->y < 0 || pfs->state->space_height < p0->y))
+            respawn_particle(pfs, p0);
+    }
+
+    for (size_t k=0; k < pfs->walls_size; k++)
+    {
+        wall = &pfs->walls_array[k];
+        wall->x += wall->vel_x * end;
+        wall->y += wall->vel_y * end;
+    }
+}
+
+void pfs_close(PFS_t *pfs)
+{
+    free(pfs->particles_array);
+
+    free(pfs->walls_array);
+    free(pfs->emitters_array);
+    free(pfs->sinks_array);
+
+    free(pfs->internal->grid.cell_start);
+    free(pfs->internal->grid.cell_particles);
+    free(pfs->internal->grid.particle_cell);
+    free(pfs->internal->grid.long_sweep);
+    free(pfs->internal->grid.long_sweeps);
+
+    free(pfs->internal->event_solver.heap);
+    free(pfs->internal->event_solver.times);
+    free(pfs->internal->event_solver.counts);
+    free(pfs->internal->event_solver.cell_of);
+    free(pfs->internal->event_solver.cell_next);
+    free(pfs->internal->event_solver.cell_prev);
+    free(pfs->internal->event_solver.cell_head);
+
+    free(pfs->internal->contact_solver.contacts);
+    free(pfs->internal->contact_solver.previous);
+    free(pfs->internal->contact_solver.deltas);
+    free(pfs->internal->contact_solver.counts);
+
+    free(pfs->internal);
+}
+
+
+static uint32_t compact_random(uint32_t *seed)
+{
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+// Rounds down after adding noise uniform in [0, 1), which rounds up with a
+// probability equal to the fraction and so is exact on average.
+static int64_t stochastic_round(float value, uint16_t noise)
+{
+    return (int64_t)floorf(value + noise * (1.0f / 65536.0f));
+}
+
+// Clamped values are counted, and the largest magnitude is tracked for
+// compact_rescale.
+static int16_t compact_velocity(PFS_compact_t *compact, float velocity, float inv_scale, uint16_t noise)
+{
+    int64_t fixed = stochastic_round(velocity * inv_scale, noise);
+    int64_t magnitude = (fixed < 0) ? -fixed : fixed;
+
+    if (magnitude > PFS_VELOCITY_MAX)
+    {
+        compact->clamped++;
+        fixed = (fixed < 0) ? -PFS_VELOCITY_MAX : PFS_VELOCITY_MAX;
+        magnitude = PFS_VELOCITY_MAX;
+    }
+    if (magnitude > compact->peak)
+        compact->peak = (int32_t)magnitude;
+
+    return (int16_t)fixed;
+}
+
+static PFS_fixed_t position_to_fixed(float position, float inv_scale)
+{
+    return (PFS_fixed_t)lrint(fmin(fmax((double)position * inv_scale, 0.0), PFS_FIXED_MAX));
+}
+
+// Moves a fixed point coordinate by delta steps, returns -1 or 1 when it hit
+// the lower or upper border and stays clamped to it.
+static int compact_move(PFS_fixed_t *position, float delta, uint16_t noise)
+{
+    int64_t moved = (int64_t)*position + stochastic_round(delta, noise);
+
+    if (moved < 0)
+    {
+        *position = 0;
+        return -1;
+    }
+    if (moved > (int64_t)PFS_FIXED_MAX)
+    {
+        *position = (PFS_fixed_t)PFS_FIXED_MAX;
+        return 1;
+    }
+
+    *position = (PFS_fixed_t)moved;
+    return 0;
+}
+
+static void compact_update_scalar(PFS_compact_t *compact, size_t begin, size_t end, float width, float height, float g, float dt)
+{
+    float scale_v = compact->max_speed / PFS_VELOCITY_MAX;
+    float inv_scale_v = PFS_VELOCITY_MAX / compact->max_speed;
+    float step_x = dt * PFS_FIXED_MAX / width;
+    float step_y = dt * PFS_FIXED_MAX / height;
+    float vel_x, vel_y;
+    uint32_t noise;
+    int hit;
+
+    for (size_t i=begin; i < end; i++)
+    {
+        vel_x = compact->vel_x[i] * scale_v;
+        vel_y = compact->vel_y[i] * scale_v;
+
+        // Fixed point cannot leave the domain, so the borders reflect.
+        noise = compact_random(&compact->seeds[0]);
+        if ((hit = compact_move(&compact->x[i], vel_x * step_x, noise & 0xffff)) != 0)
+            vel_x = -hit * fabs(vel_x);
+        if ((hit = compact_move(&compact->y[i], vel_y * step_y, noise >> 16)) != 0)
+            vel_y = -hit * fabs(vel_y);
+        vel_y += g * dt;
+
+        noise = compact_random(&compact->seeds[0]);
+        compact->vel_x[i] = compact_velocity(compact, vel_x, inv_scale_v, noise & 0xffff);
+        compact->vel_y[i] = compact_velocity(compact, vel_y, inv_scale_v, noise >> 16);
+    }
+}
+
+#ifdef __AVX2__
+static __m256i compact_random_avx2(__m256i *seed)
+{
+    *seed = _mm256_xor_si256(*seed, _mm256_slli_epi32(*seed, 13));
+    *seed = _mm256_xor_si256(*seed, _mm256_srli_epi32(*seed, 17));
+    *seed = _mm256_xor_si256(*seed, _mm256_slli_epi32(*seed, 5));
+    return *seed;
+}
+
+// Noise from the low or high 16 bits of each lane, uniform in [0, 1).
+static __m256 compact_noise(__m256i random, int high)
+{
+    __m256i bits = high ? _mm256_srli_epi32(random, 16) : _mm256_and_si256(random, _mm256_set1_epi32(0xffff));
+    return _mm256_mul_ps(_mm256_cvtepi32_ps(bits), _mm256_set1_ps(1.0f / 65536.0f));
+}
+
+static __m256i compact_load_fixed(const PFS_fixed_t *data)
+{
+#if PFS_COMPACT_POSITION_BITS == 16
+    return _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)data));
+#else
+    return _mm256_loadu_si256((const __m256i *)data);
+#endif
+}
+
+static void compact_store_fixed(PFS_fixed_t *data, __m256i value)
+{
+#if PFS_COMPACT_POSITION_BITS == 16
+    _mm_storeu_si128((__m128i *)data, _mm_packus_epi32(_mm256_castsi256_si128(value), _mm256_extracti128_si256(value, 1)));
+#else
+    _mm256_storeu_si256((__m256i *)data, value);
+#endif
+}
+
+// Integer counterpart of compact_move. Both borders are tested before the
+// add, so 32-bit positions near the top never overflow.
+static __m256i compact_move_avx2(__m256i position, __m256 delta, __m256 noise, __m256 *velocity)
+{
+    const __m256i fixed_max = _mm256_set1_epi32((int32_t)PFS_FIXED_MAX);
+    const __m256 limit = _mm256_set1_ps(PFS_FIXED_MAX);
+    __m256 rounded = _mm256_floor_ps(_mm256_add_ps(delta, noise));
+    __m256i steps = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(rounded, _mm256_sub_ps(_mm256_setzero_ps(), limit)), limit));
+    __m256i below = _mm256_cmpgt_epi32(_mm256_sub_epi32(_mm256_setzero_si256(), position), steps);
+    __m256i above = _mm256_cmpgt_epi32(steps, _mm256_sub_epi32(fixed_max, position));
+    __m256 magnitude = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), *velocity);
+
+    *velocity = _mm256_blendv_ps(*velocity, magnitude, _mm256_castsi256_ps(below));
+    *velocity = _mm256_blendv_ps(*velocity, _mm256_sub_ps(_mm256_setzero_ps(), magnitude), _mm256_castsi256_ps(above));
+
+    position = _mm256_add_epi32(position, steps);
+    position = _mm256_andnot_si256(below, position);
+    return _mm256_blendv_epi8(position, fixed_max, above);
+}
+
+// Vector counterpart of compact_velocity, the peak is reduced by the caller.
+static __m256i compact_velocity_fixed(__m256 velocity, __m256 inv_scale, __m256 noise, __m256 *peak, size_t *clamped)
+{
+    const __m256 limit = _mm256_set1_ps(PFS_VELOCITY_MAX);
+    __m256 fixed = _mm256_floor_ps(_mm256_add_ps(_mm256_mul_ps(velocity, inv_scale), noise));
+    __m256 magnitude = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), fixed);
+
+    *clamped += __builtin_popcount(_mm256_movemask_ps(_mm256_cmp_ps(magnitude, limit, _CMP_GT_OQ)));
+    *peak = _mm256_max_ps(*peak, magnitude);
+
+    fixed = _mm256_min_ps(_mm256_max_ps(fixed, _mm256_sub_ps(_mm256_setzero_ps(), limit)), limit);
+    return _mm256_cvttps_epi32(fixed);
+}
+
+static size_t compact_update_avx2(PFS_compact_t *compact, float width, float height, float g, float dt)
+{
+    const __m256 scale_v = _mm256_set1_ps(compact->max_speed / PFS_VELOCITY_MAX);
+    const __m256 inv_scale_v = _mm256_set1_ps(PFS_VELOCITY_MAX / compact->max_speed);
+    const __m256 step_x = _mm256_set1_ps(dt * PFS_FIXED_MAX / width);
+    const __m256 step_y = _mm256_set1_ps(dt * PFS_FIXED_MAX / height);
+    const __m256 gravity = _mm256_set1_ps(g * dt);
+    __m256i seed = _mm256_loadu_si256((const __m256i *)compact->seeds);
+    __m256 peak = _mm256_setzero_ps();
+    float peaks[8];
+    __m256i random;
+    __m256i packed;
+    size_t i;
+
+    for (i=0; i + 8 <= compact->size; i += 8)
+    {
+        __m256 vel_x = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)&compact->vel_x[i]))), scale_v);
+        __m256 vel_y = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)&compact->vel_y[i]))), scale_v);
+        __m256i x = compact_load_fixed(&compact->x[i]);
+        __m256i y = compact_load_fixed(&compact->y[i]);
+
+        random = compact_random_avx2(&seed);
+        x = compact_move_avx2(x, _mm256_mul_ps(vel_x, step_x), compact_noise(random, 0), &vel_x);
+        y = compact_move_avx2(y, _mm256_mul_ps(vel_y, step_y), compact_noise(random, 1), &vel_y);
+        vel_y = _mm256_add_ps(vel_y, gravity);
+
+        compact_store_fixed(&compact->x[i], x);
+        compact_store_fixed(&compact->y[i], y);
+
+        random = compact_random_avx2(&seed);
+        packed = _mm256_packs_epi32(compact_velocity_fixed(vel_x, inv_scale_v, compact_noise(random, 0), &peak, &compact->clamped),
+                                    compact_velocity_fixed(vel_y, inv_scale_v, compact_noise(random, 1), &peak, &compact->clamped));
+        // packs interleaves per 128-bit lane: x0-3 y0-3 x4-7 y4-7.
+        packed = _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0));
+        _mm_storeu_si128((__m128i *)&compact->vel_x[i], _mm256_castsi256_si128(packed));
+        _mm_storeu_si128((__m128i *)&compact->vel_y[i], _mm256_extracti128_si256(packed, 1));
+    }
+
+    _mm256_storeu_si256((__m256i *)compact->seeds, seed);
+    _mm256_storeu_ps(peaks, _mm256_min_ps(peak, _mm256_set1_ps(PFS_VELOCITY_MAX)));
+    for (size_t k=0; k < 8; k++)
+        if ((int32_t)peaks[k] > compact->peak)
+            compact->peak = (int32_t)peaks[k];
+
+    return i;
+}
+#endif
+
+static size_t compact_row(PFS_fixed_t y, double row_scale, size_t rows)
+{
+    size_t row = (size_t)(y * row_scale);
+    return (row < rows) ? row : rows - 1;
+}
+
+static void compact_swap(PFS_compact_t *compact, size_t i, size_t j)
+{
+    PFS_fixed_t position;
+    int16_t velocity;
+
+    position = compact->x[i]; compact->x[i] = compact->x[j]; compact->x[j] = position;
+    position = compact->y[i]; compact->y[i] = compact->y[j]; compact->y[j] = position;
+    velocity = compact->vel_x[i]; compact->vel_x[i] = compact->vel_x[j]; compact->vel_x[j] = velocity;
+    velocity = compact->vel_y[i]; compact->vel_y[i] = compact->vel_y[j]; compact->vel_y[j] = velocity;
+}
+
+// In place bucket sort of the store by row, so the collision pass needs no
+// index array. Particles rarely change rows, so few of them move.
+static void compact_sort_rows(PFS_compact_t *compact, size_t rows, double row_scale)
+{
+    size_t row;
+
+    memset(compact->row_start, 0, sizeof(size_t) * (rows + 1));
+    for (size_t i=0; i < compact->size; i++)
+        compact->row_start[compact_row(compact->y[i], row_scale, rows) + 1]++;
+    for (size_t r=0; r < rows; r++)
+    {
+        compact->row_start[r + 1] += compact->row_start[r];
+        compact->row_next[r] = compact->row_start[r];
+    }
+
+    for (size_t r=0; r < rows; r++)
+        while (compact->row_next[r] < compact->row_start[r + 1])
+        {
+            row = compact_row(compact->y[compact->row_next[r]], row_scale, rows);
+            if (row == r)
+                compact->row_next[r]++;
+            else
+                compact_swap(compact, compact->row_next[r], compact->row_next[row]++);
+        }
+}
+
+static size_t compact_decode_row(PFS_compact_t *compact, PFS_compact_entry_t *entries, size_t begin, size_t end, double scale_x, double scale_y, float scale_v)
+{
+    PFS_compact_entry_t *entry;
+    PFS_compact_entry_t temp;
+    size_t j;
+
+    for (size_t i=begin; i < end; i++)
+    {
+        entry = &entries[i - begin];
+        entry->x = compact->x[i];
+        entry->y = compact->y[i];
+        entry->vel_x = compact->vel_x[i];
+        entry->vel_y = compact->vel_y[i];
+        entry->particle.x = entry->x * scale_x;
+        entry->particle.y = entry->y * scale_y;
+        entry->particle.vel_x = entry->vel_x * scale_v;
+        entry->particle.vel_y = entry->vel_y * scale_v;
+        entry->hit = false;
+    }
+
+    // Rows are written back in this order, so they stay nearly sorted by x
+    // and the insertion sort is close to linear.
+    for (size_t i=1; i < end - begin; i++)
+    {
+        temp = entries[i];
+        for (j=i; j > 0 && entries[j - 1].particle.x > temp.particle.x; j--)
+            entries[j] = entries[j - 1];
+        entries[j] = temp;
+    }
+
+    return end - begin;
+}
+
+// Only the change of a particle that was hit is rounded back, so untouched
+// particles keep their exact fixed point values.
+static void compact_encode_row(PFS_compact_t *compact, PFS_compact_entry_t *entries, size_t begin, size_t end, double scale_x, double scale_y, float inv_scale_v)
+{
+    PFS_compact_entry_t *entry;
+    uint32_t noise;
+    int hit;
+
+    for (size_t i=begin; i < end; i++)
+    {
+        entry = &entries[i - begin];
+        compact->x[i] = entry->x;
+        compact->y[i] = entry->y;
+        compact->vel_x[i] = entry->vel_x;
+        compact->vel_y[i] = entry->vel_y;
+        if (!entry->hit)
+            continue;
+
+        noise = compact_random(&compact->seeds[0]);
+        if ((hit = compact_move(&compact->x[i], (entry->particle.x - (float)(entry->x * scale_x)) / scale_x, noise & 0xffff)) != 0)
+            entry->particle.vel_x = -hit * fabs(entry->particle.vel_x);
+        if ((hit = compact_move(&compact->y[i], (entry->particle.y - (float)(entry->y * scale_y)) / scale_y, noise >> 16)) != 0)
+            entry->particle.vel_y = -hit * fabs(entry->particle.vel_y);
+
+        noise = compact_random(&compact->seeds[0]);
+        compact->vel_x[i] = compact_velocity(compact, entry->particle.vel_x, inv_scale_v, noise & 0xffff);
+        compact->vel_y[i] = compact_velocity(compact, entry->particle.vel_y, inv_scale_v, noise >> 16);
+    }
+}
+
+// One elastic pass: approaching pairs bounce with e and overlaps are pushed
+// apart, there is no iteration and no warm start.
+static void compact_collide_pair(PFS_t *pfs, PFS_compact_entry_t *e0, PFS_compact_entry_t *e1)
+{
+    PFS_particle_t *p0 = &e0->particle;
+    PFS_particle_t *p1 = &e1->particle;
+    float radius = pfs->state->particle_radius;
+    float dist_x = p1->x - p0->x;
+    float dist_y = p1->y - p0->y;
+    float dist;
+    float normal_x;
+    float normal_y;
+    float approach;
+    float depth;
+
+    if (dist_x * dist_x + dist_y * dist_y >= radius * radius)
+        return;
+
+    dist = sqrt(dist_x * dist_x + dist_y * dist_y);
+    normal_x = (dist > 0.0f) ? dist_x / dist : 1.0f;
+    normal_y = (dist > 0.0f) ? dist_y / dist : 0.0f;
+
+    approach = (p1->vel_x - p0->vel_x) * normal_x + (p1->vel_y - p0->vel_y) * normal_y;
+    if (approach < 0.0f)
+    {
+        approach *= (1.0f + pfs->state->e) / 2.0f;
+        p0->vel_x += normal_x * approach;
+        p0->vel_y += normal_y * approach;
+        p1->vel_x -= normal_x * approach;
+        p1->vel_y -= normal_y * approach;
+    }
+
+    depth = fmax(radius - dist - PFS_CONTACT_SLOP * radius, 0.0f) / 2.0f;
+    p0->x -= normal_x * depth;
+    p0->y -= normal_y * depth;
+    p1->x += normal_x * depth;
+    p1->y += normal_y * depth;
+
+    e0->hit = true;
+    e1->hit = true;
+}
+
+// Rows are one contact distance high, so a particle only meets the particles
+// of its own and the neighbouring rows. They are decoded two at a time, so
+// only a window of O(sqrt(n)) particles is ever unpacked.
+static void compact_collide(PFS_t *pfs, PFS_compact_t *compact)
+{
+    PFS_state_t *state = pfs->state;
+    PFS_compact_entry_t *current;
+    PFS_compact_entry_t *next;
+    PFS_compact_entry_t *temp;
+    double scale_x = state->space_width / PFS_FIXED_MAX;
+    double scale_y = state->space_height / PFS_FIXED_MAX;
+    float scale_v = compact->max_speed / PFS_VELOCITY_MAX;
+    float inv_scale_v = PFS_VELOCITY_MAX / compact->max_speed;
+    float radius = state->particle_radius;
+    size_t rows = (size_t)fmax(1.0f, state->space_height / radius);
+    size_t current_size;
+    size_t next_size;
+    size_t widest = 0;
+    size_t low;
+
+    if (compact->rows_capacity < rows + 1)
+    {
+        compact->rows_capacity = rows + 1;
+        compact->row_start = (size_t *)realloc(compact->row_start, sizeof(size_t) * compact->rows_capacity);
+        compact->row_next = (size_t *)realloc(compact->row_next, sizeof(size_t) * compact->rows_capacity);
+    }
+    compact_sort_rows(compact, rows, rows / ((double)PFS_FIXED_MAX + 1.0));
+
+    for (size_t r=0; r < rows; r++)
+        if (compact->row_start[r + 1] - compact->row_start[r] > widest)
+            widest = compact->row_start[r + 1] - compact->row_start[r];
+    if (compact->window_capacity < widest)
+    {
+        compact->window_capacity = widest;
+        compact->window[0] = (PFS_compact_entry_t *)realloc(compact->window[0], sizeof(PFS_compact_entry_t) * widest);
+        compact->window[1] = (PFS_compact_entry_t *)realloc(compact->window[1], sizeof(PFS_compact_entry_t) * widest);
+    }
+
+    current = compact->window[0];
+    next = compact->window[1];
+    current_size = compact_decode_row(compact, current, compact->row_start[0], compact->row_start[1], scale_x, scale_y, scale_v);
+
+    for (size_t r=0; r < rows; r++)
+    {
+        next_size = 0;
+        if (r + 1 < rows)
+            next_size = compact_decode_row(compact, next, compact->row_start[r + 1], compact->row_start[r + 2], scale_x, scale_y, scale_v);
+
+        // Both rows are sorted by x, so the candidates are a sliding range.
+        low = 0;
+        for (size_t i=0; i < current_size; i++)
+        {
+            for (size_t j=i+1; j < current_size && current[j].particle.x - current[i].particle.x < radius; j++)
+                compact_collide_pair(pfs, &current[i], &current[j]);
+
+            while (low < next_size && next[low].particle.x <= current[i].particle.x - radius)
+                low++;
+            for (size_t j=low; j < next_size && next[j].particle.x < current[i].particle.x + radius; j++)
+                compact_collide_pair(pfs, &current[i], &next[j]);
+
+            for (size_t k=0; k < pfs->walls_size; k++)
+                if (collide_particle_wall(state->e, radius, &current[i].particle, &pfs->walls_array[k]))
+                    current[i].hit = true;
+        }
+
+        compact_encode_row(compact, current, compact->row_start[r], compact->row_start[r + 1], scale_x, scale_y, inv_scale_v);
+
+        temp = current;
+        current = next;
+        next = temp;
+        current_size = next_size;
+    }
+}
+
+// Keeps the fastest component between an eighth and half of the fixed range.
+// Halving leaves room for the next impacts and gravity, doubling back when
+// the gas slows down is exact and restores the resolution.
+static void compact_rescale(PFS_compact_t *compact)
+{
+    uint32_t noise;
+
+    if (compact->peak > PFS_VELOCITY_MAX / 2.0f)
+    {
+        compact->max_speed *= 2.0f;
+        for (size_t i=0; i < compact->size; i++)
+        {
+            noise = compact_random(&compact->seeds[0]);
+            compact->vel_x[i] = (int16_t)stochastic_round(compact->vel_x[i] * 0.5f, noise & 0xffff);
+            compact->vel_y[i] = (int16_t)stochastic_round(compact->vel_y[i] * 0.5f, noise >> 16);
+        }
+    }
+    else if (compact->peak > 0 && compact->peak < PFS_VELOCITY_MAX / 8.0f)
+    {
+        compact->max_speed *= 0.5f;
+        for (size_t i=0; i < compact->size; i++)
+        {
+            compact->vel_x[i] *= 2;
+            compact->vel_y[i] *= 2;
+        }
+    }
+
+    compact->peak = 0;
+}
+
+void pfs_compact_create(PFS_compact_t *compact, size_t capacity)
+{
+    compact->size = 0;
+    compact->capacity = capacity;
+    compact->max_speed = 1.0f;
+    compact->peak = 0;
+    compact->clamped = 0;
+    for (size_t i=0; i < 8; i++)
+        compact->seeds[i] = 0x9e3779b9u * (uint32_t)(i + 1);
+    compact->x = (PFS_fixed_t *)malloc(sizeof(PFS_fixed_t) * capacity);
+    compact->y = (PFS_fixed_t *)malloc(sizeof(PFS_fixed_t) * capacity);
+    compact->vel_x = (int16_t *)malloc(sizeof(int16_t) * capacity);
+    compact->vel_y = (int16_t *)malloc(sizeof(int16_t) * capacity);
+    compact->row_start = NULL;
+    compact->row_next = NULL;
+    compact->rows_capacity = 0;
+    compact->window[0] = NULL;
+    compact->window[1] = NULL;
+    compact->window_capacity = 0;
+}
+
+void pfs_compact_pack(PFS_t *pfs, PFS_compact_t *compact)
+{
+    float inv_scale_x = PFS_FIXED_MAX / pfs->state->space_width;
+    float inv_scale_y = PFS_FIXED_MAX / pfs->state->space_height;
+    float inv_scale_v;
+    float max_speed = 0.0f;
+    PFS_particle_t *particle;
+    uint32_t noise;
+
+    compact->size = (pfs->particles_size < compact->capacity) ? pfs->particles_size : compact->capacity;
+    for (size_t i=0; i < compact->size; i++)
+    {
+        particle = &pfs->particles_array[i];
+        max_speed = fmax(max_speed, fmax(fabs(particle->vel_x), fabs(particle->vel_y)));
+    }
+    compact->max_speed = (max_speed > 0.0f) ? 2.0f * max_speed : 1.0f;
+    compact->peak = 0;
+    compact->clamped = 0;
+    inv_scale_v = PFS_VELOCITY_MAX / compact->max_speed;
+
+    for (size_t i=0; i < compact->size; i++)
+    {
+        particle = &pfs->particles_array[i];
+        compact->x[i] = position_to_fixed(particle->x, inv_scale_x);
+        compact->y[i] = position_to_fixed(particle->y, inv_scale_y);
+
+        noise = compact_random(&compact->seeds[0]);
+        compact->vel_x[i] = compact_velocity(compact, particle->vel_x, inv_scale_v, noise & 0xffff);
+        compact->vel_y[i] = compact_velocity(compact, particle->vel_y, inv_scale_v, noise >> 16);
+    }
+}
+
+void pfs_compact_unpack(PFS_t *pfs, PFS_compact_t *compact)
+{
+    double scale_x = pfs->state->space_width / PFS_FIXED_MAX;
+    double scale_y = pfs->state->space_height / PFS_FIXED_MAX;
+    float scale_v = compact->max_speed / PFS_VELOCITY_MAX;
+    PFS_particle_t *particle;
+
+    pfs_reserve(pfs, compact->size);
+    pfs->particles_size = compact->size;
+    for (size_t i=0; i < compact->size; i++)
+    {
+        particle = &pfs->particles_array[i];
+        particle->x = compact->x[i] * scale_x;
+        particle->y = compact->y[i] * scale_y;
+        particle->vel_x = compact->vel_x[i] * scale_v;
+        particle->vel_y = compact->vel_y[i] * scale_v;
+    }
+}
+
+void pfs_compact_update(PFS_t *pfs, PFS_compact_t *compact, float delta_time)
+{
+    float real_delta_time = delta_time * pfs->state->time_speed;
+    size_t done = 0;
+
+#ifdef __AVX2__
+    done = compact_update_avx2(compact, pfs->state->space_width, pfs->state->space_height, pfs->state->g, real_delta_time);
+#endif
+
+    compact_update_scalar(compact, done, compact->size, pfs->state->space_width, pfs->state->space_height, pfs->state->g, real_delta_time);
+    compact_collide(pfs, compact);
+    compact_rescale(compact);
+}
+
+void pfs_compact_close(PFS_compact_t *compact)
+{
+    free(compact->x);
+    free(compact->y);
+    free(compact->vel_x);
+    free(compact->vel_y);
+    free(compact->row_start);
+    free(compact->row_next);
+    free(compact->window[0]);
+    free(compact->window[1]);
+}
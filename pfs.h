@@ -1,7 +1,11 @@
+#ifndef PFS_H
+#define PFS_H
+
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 
 
@@ -9,6 +13,53 @@
 #define M_PI 3.1415926535897932384626433
 #endif
 
+// Bumped on every change to the public structs or functions below; the minor
+// version for additions, the major version for anything that breaks callers.
+#define PFS_VERSION_MAJOR 1
+#define PFS_VERSION_MINOR 0
+#define PFS_VERSION_PATCH 0
+#define PFS_VERSION ((PFS_VERSION_MAJOR * 10000) + (PFS_VERSION_MINOR * 100) + PFS_VERSION_PATCH)
+
+#define PFS_NONE ((size_t)-1)
+
+#ifndef PFS_COMPACT_POSITION_BITS
+#define PFS_COMPACT_POSITION_BITS 16
+#endif
+
+#if PFS_COMPACT_POSITION_BITS == 16
+typedef uint16_t PFS_fixed_t;
+#define PFS_FIXED_MAX 65535.0f
+#elif PFS_COMPACT_POSITION_BITS == 32
+typedef uint32_t PFS_fixed_t;
+#define PFS_FIXED_MAX 2147483520.0f
+#else
+#error "PFS_COMPACT_POSITION_BITS must be 16 or 32"
+#endif
+#define PFS_VELOCITY_MAX 32767.0f
+#define PFS_CONTACT_SLOP 0.01f
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum
+{
+    PFS_SOLVER_TIME_STEPPED,
+    PFS_SOLVER_EVENT_DRIVEN,
+    PFS_SOLVER_COMPACT
+} PFS_solver_t;
+
+typedef enum
+{
+    PFS_CONTACT_GAUSS_SEIDEL,
+    PFS_CONTACT_JACOBI
+} PFS_contact_solver_type_t;
+
+typedef enum
+{
+    PFS_BROADPHASE_BRUTE_FORCE,
+    PFS_BROADPHASE_GRID
+} PFS_broadphase_t;
 
 typedef struct
 {
@@ -19,6 +70,14 @@ typedef struct
     float start_velocity_magnitude;
     float e;
     float g;
+    PFS_solver_t solver;
+    PFS_broadphase_t broadphase;
+    bool open_boundaries;
+    PFS_contact_solver_type_t contact_solver;
+    int contact_iterations;
+    float contact_relaxation;
+    float contact_warm_start;
+    float contact_bounce_threshold;
 } PFS_state_t;
 
 typedef struct
@@ -31,6 +90,26 @@ typedef struct
     float vel_x;
 }  PFS_wall_t;
 
+typedef struct
+{
+    float x;
+    float y;
+    float width;
+    float height;
+    float rate;
+    float vel_x;
+    float vel_y;
+    float accumulator;
+} PFS_emitter_t;
+
+typedef struct
+{
+    float x;
+    float y;
+    float width;
+    float height;
+} PFS_sink_t;
+
 typedef struct
 {
     float x;
@@ -38,21 +117,102 @@ typedef struct
     float vel_x;
     float vel_y;
 } PFS_particle_t;
- 
+
+// A particle of the collision window, decoded together with the fixed point
+// values it came from so that only its change is rounded back.
+typedef struct
+{
+    PFS_particle_t particle;
+    PFS_fixed_t x, y;
+    int16_t vel_x, vel_y;
+    bool hit;
+} PFS_compact_entry_t;
+
+// Compact solver for very large counts, selected as PFS_SOLVER_COMPACT and
+// stepped by pfs_compact_update: the update kernels move whole vectors of this
+// structure of arrays under gravity, then one collision pass against the
+// walls and the neighbouring particles runs on rows of the domain decoded two
+// at a time. Unlike the other solvers the domain borders reflect and there is
+// no contact iteration, emitters and sinks need the particles unpacked.
+//
+// Positions are fixed point over [0, space_width] x [0, space_height] and
+// move in integer steps, so 32-bit positions keep all their bits. Velocities
+// are 16-bit fixed point over [-max_speed, max_speed]. The scale doubles once
+// the fastest component passes half of it and halves when it drops below an
+// eighth; a velocity that still saturates within one update is clamped and
+// counted in clamped. Every store rounds stochastically, so increments below
+// one step, like gravity over a short substep, still add up on average.
+typedef struct
+{
+    size_t size;
+    size_t capacity;
+    float max_speed;
+    int32_t peak;
+    size_t clamped;
+    uint32_t seeds[8];
+    PFS_fixed_t *x;
+    PFS_fixed_t *y;
+    int16_t *vel_x;
+    int16_t *vel_y;
+    size_t *row_start;
+    size_t *row_next;
+    size_t rows_capacity;
+    PFS_compact_entry_t *window[2];
+    size_t window_capacity;
+} PFS_compact_t;
+
+// Solver scratch space, owned by pfs_create and pfs_close.
+typedef struct PFS_internal PFS_internal_t;
+
 typedef struct
 {   
     PFS_state_t *state;
     size_t particles_size;
+    size_t particles_capacity;
     size_t walls_size;
     size_t walls_capacity;
+    size_t emitters_size;
+    size_t emitters_capacity;
+    size_t sinks_size;
+    size_t sinks_capacity;
     PFS_particle_t *particles_array;
     PFS_wall_t *walls_array;
+    PFS_emitter_t *emitters_array;
+    PFS_sink_t *sinks_array;
+    PFS_internal_t *internal;
 } PFS_t;
 
+int  pfs_version(void);
+
+// The demo's values for every field. Start from it and override what differs,
+// fields added in later minor versions get their default here.
+PFS_state_t pfs_state_default(void);
+
 void pfs_create(PFS_t *pfs, PFS_state_t *state, size_t particles);
 void pfs_start_random(PFS_t *pfs);
 void pfs_add_wall(PFS_t *pfs, float x, float y, float width, float height);
+// Emitters only fill free slots of the particle pool, which pfs_create sizes
+// to the initial particle count. Call pfs_reserve for room to grow, otherwise
+// an emitter only replaces particles removed by sinks or open boundaries.
+void pfs_add_emitter(PFS_t *pfs, float x, float y, float width, float height, float rate, float vel_x, float vel_y);
+void pfs_add_sink(PFS_t *pfs, float x, float y, float width, float height);
+void pfs_reserve(PFS_t *pfs, size_t capacity);
+void pfs_update_sources(PFS_t *pfs, float delta_time);
 void pfs_update_particle(PFS_t *pfs, PFS_particle_t *particle, float delta_time);
 void pfs_handle_collisions(PFS_t *pfs);
+void pfs_handle_collisions_swept(PFS_t *pfs, float delta_time);
+// Exact between events, particles follow parabolas under g and walls move linearly.
+void pfs_advance_events(PFS_t *pfs, float delta_time);
 void pfs_close(PFS_t *pfs);
 
+void pfs_compact_create(PFS_compact_t *compact, size_t capacity);
+void pfs_compact_pack(PFS_t *pfs, PFS_compact_t *compact);
+void pfs_compact_unpack(PFS_t *pfs, PFS_compact_t *compact);
+void pfs_compact_update(PFS_t *pfs, PFS_compact_t *compact, float delta_time);
+void pfs_compact_close(PFS_compact_t *compact);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef PFS_INTERNAL_H
+#define PFS_INTERNAL_H
+
+#include "pfs.h"
+
+// Solver internals shared by pfs.c and the tests, not installed.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum
+{
+    PFS_EVENT_PARTICLE,
+    PFS_EVENT_WALL,
+    PFS_EVENT_CELL
+} PFS_event_type_t;
+
+typedef struct
+{
+    float time;
+    PFS_event_type_t type;
+    size_t a;
+    size_t b;
+    unsigned int count_a;
+    unsigned int count_b;
+    float normal_x;
+    float normal_y;
+} PFS_event_t;
+
+typedef struct
+{
+    PFS_event_t *heap;
+    size_t heap_size;
+    size_t heap_capacity;
+    float *times;
+    unsigned int *counts;
+    size_t *cell_of;
+    size_t *cell_next;
+    size_t *cell_prev;
+    size_t *cell_head;
+    size_t particles_capacity;
+    size_t cells_capacity;
+    size_t cells_x, cells_y;
+    float cell_size;
+} PFS_event_solver_t;
+
+// Particle indices bucketed by cell, rebuilt from scratch for every pass.
+// The particles of cell c are cell_particles[cell_start[c] .. cell_start[c + 1]).
+// The swept pass flags particles travelling further than the cells allow in
+// long_sweep and lists them in long_sweeps.
+typedef struct
+{
+    size_t *cell_start;
+    size_t *cell_particles;
+    size_t *particle_cell;
+    size_t particles_capacity;
+    size_t cells_capacity;
+    size_t cells_x, cells_y;
+    float cell_size;
+    bool *long_sweep;
+    size_t *long_sweeps;
+    size_t long_sweeps_size;
+    size_t long_sweeps_capacity;
+} PFS_grid_t;
+
+// Particle pair a < b, or particle a against wall b with the normal pointing
+// from the wall to the particle. The restitution part of the impulse is kept
+// in bounce so that only the non-penetration part is warm started.
+typedef struct
+{
+    size_t a;
+    size_t b;
+    bool wall;
+    float normal_x;
+    float normal_y;
+    float target;
+    float impulse;
+    float bounce;
+} PFS_contact_t;
+
+typedef struct
+{
+    PFS_contact_t *contacts;
+    size_t contacts_size;
+    size_t contacts_capacity;
+    PFS_contact_t *previous;
+    size_t previous_size;
+    size_t previous_capacity;
+    float *deltas;
+    size_t deltas_capacity;
+    unsigned int *counts;
+    size_t counts_capacity;
+} PFS_contact_solver_t;
+
+struct PFS_internal
+{
+    PFS_grid_t grid;
+    PFS_event_solver_t event_solver;
+    PFS_contact_solver_t contact_solver;
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
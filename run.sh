@@ -1,7 +1,6 @@
 #!/bin/bash
 
 set -xe
-gcc -Wall -Wextra -std=c17 main.c pfs.c simlib.c -I./ -lm -lraylib -o main
-./main
+make -j"$(nproc)" demo
+./build/main "$@"
 ffplay -fs videos/*
-
@@ -1,14 +1,175 @@
 #include "simlib.h"
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <rlgl.h>
+#include <raymath.h>
+#include <unistd.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-FFMPEG *StartFFMPEGProcess(const size_t width, const size_t height, const size_t FPS, const char *output_dir, const char *log_level)
+#ifdef SIMLIB_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef SIMLIB_LIBAV
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/opt.h>
+#endif
+
+#define READ_END         0
+#define WRITE_END        1
+#define FRAME_PIPELINE_SPINS 64
+
+struct FFMPEG
+{
+    size_t width;
+    size_t height;
+    int pipe;
+    pid_t pid;
+};
+
+typedef struct ArchiveJob
+{
+    struct ArchiveJob *next;
+    size_t index;
+    size_t frames;
+    size_t bytes;
+    uint8_t *data;
+} ArchiveJob;
+
+// Lossless sink: frames are copied on the calling thread and compressed and
+// written by a pool of worker threads. Every job reserves its bytes before it
+// is filled and releases them once written, so the chunk being filled, the
+// queued ones and the ones being compressed never exceed memory_limit.
+struct FrameArchive
+{
+    enum EncoderBackend backend;
+    size_t width;
+    size_t height;
+    char directory[OUTPUT_NAME_CAP];
+    size_t frame_index;
+    size_t chunk_index;
+    size_t chunk_frames;
+    int compression_level;
+    ArchiveJob *current;
+    ArchiveJob *queue_head;
+    ArchiveJob *queue_tail;
+    size_t memory_used;
+    size_t memory_limit;
+    bool closing;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t memory_freed;
+    int threads_size;
+    pthread_t *threads;
+};
+
+#ifdef SIMLIB_LIBAV
+struct ConvertJob;
+
+// RGBA to YUV420 conversion is split into bands over a persistent pool of
+// convert_threads - 1 workers plus the calling thread.
+struct LibavEncoder
+{
+    size_t width;
+    size_t height;
+    int64_t frame_index;
+    int convert_threads;
+    const uint8_t *data;
+    struct ConvertJob *jobs;
+    pthread_t *threads;
+    unsigned long generation;
+    int pending;
+    bool closing;
+    pthread_mutex_t mutex;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    AVFormatContext *format;
+    AVCodecContext *codec;
+    AVStream *stream;
+    AVFrame *frame;
+    AVPacket *packet;
+};
+#endif
+
+struct Encoder
+{
+    enum EncoderBackend backend;
+    FFMPEG *ffmpeg;
+    FrameArchive *archive;
+#ifdef SIMLIB_LIBAV
+    LibavEncoder *libav;
+#endif
+};
+
+// Two-slot handoff between one producer and one consumer thread. Each slot
+// is owned by exactly one side at a time, tracked by its atomic full flag.
+// A side that has to wait spins briefly and then sleeps on the condition.
+struct FramePipeline
+{
+    void *slots[2];
+    atomic_int full[2];
+    atomic_bool stopped;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    size_t write_index;
+    size_t read_index;
+};
+
+
+// A NULL timestamp means now. Outputs of one simulation pass the one taken by
+// InitSimulation, so they share it.
+static const char *FormatTimestamp(char buffer[TIMESTAMP_CAP], const char *timestamp)
+{
+    if (timestamp != NULL)
+        return timestamp;
+
+    time_t current_time = time(NULL);
+    strftime(buffer, TIMESTAMP_CAP, "%Y-%m-%d %H:%M:%S", localtime(&current_time));
+    return buffer;
+}
+
+// Named outputs get a suffix after the timestamp.
+static void FormatOutputName(char output_name[OUTPUT_NAME_CAP], const char *output_dir, const char *formated_time, const char *name, const char *extension)
+{
+    if (name != NULL && name[0] != '\0')
+        snprintf(output_name, OUTPUT_NAME_CAP, "%s/%s %s.%s", output_dir, formated_time, name, extension);
+    else
+        snprintf(output_name, OUTPUT_NAME_CAP, "%s/%s.%s", output_dir, formated_time, extension);
+}
+
+EncoderSettings DefaultEncoderSettings(void)
+{
+    EncoderSettings settings;
+    settings.backend           = ENCODER_FFMPEG_PIPE;
+    settings.codec             = "libx264";
+    settings.preset            = "medium";
+    settings.crf               = 23;
+    settings.threads           = 0;
+    settings.convert_threads   = 4;
+    settings.chunk_frames      = 16;
+    settings.compression_level = 3;
+    settings.archive_memory    = 1024;
+    return settings;
+}
+
+FFMPEG *StartFFMPEGProcess(const size_t width, const size_t height, const size_t FPS, const char *output_dir, const char *name, const char *timestamp, const char *log_level, EncoderSettings settings)
 {
     mkdir(output_dir, S_IRWXU | S_IRWXG | S_IRWXO);
     
-    char formated_time[32];
-    time_t current_time = time(NULL);
-    struct tm* tm_info = localtime(&current_time);
-    strftime(formated_time, 32, "%Y-%m-%d %H:%M:%S", tm_info);
+    char time_buffer[TIMESTAMP_CAP];
+    const char *formated_time = FormatTimestamp(time_buffer, timestamp);
 
     int pipe_fd[2];
     if (pipe(pipe_fd) < 0)
@@ -29,11 +190,15 @@ FFMPEG *StartFFMPEGProcess(const size_t width, const size_t height, const size_t
         
         char str_resolution[RESOLUTION_CAP];
         char str_fps[FPS_CAP];
+        char str_crf[FPS_CAP];
+        char str_threads[FPS_CAP];
         char str_output_name[OUTPUT_NAME_CAP];
 
         snprintf(str_resolution, RESOLUTION_CAP, "%zux%zu", width, height);
         snprintf(str_fps, FPS_CAP, "%zu", FPS);
-        snprintf(str_output_name, OUTPUT_NAME_CAP, "%s/%s.mp4", output_dir, formated_time);
+        snprintf(str_crf, FPS_CAP, "%d", settings.crf);
+        snprintf(str_threads, FPS_CAP, "%d", settings.threads);
+        FormatOutputName(str_output_name, output_dir, formated_time, name, "mp4");
 
         int ret = execlp("ffmpeg", 
             "ffmpeg",
@@ -47,7 +212,10 @@ FFMPEG *StartFFMPEGProcess(const size_t width, const size_t height, const size_t
             "-an", 
             "-i", "-",
             
-            "-c:v", "libx264",
+            "-c:v", settings.codec,
+            "-preset", settings.preset,
+            "-crf", str_crf,
+            "-threads", str_threads,
             str_output_name,
             NULL);
 
@@ -86,6 +254,1089 @@ void CloseFFMPEG(FFMPEG *ffmpeg)
     free(ffmpeg);
 }
 
+#ifdef SIMLIB_LIBAV
+typedef struct ConvertJob
+{
+    LibavEncoder *encoder;
+    size_t row_begin;
+    size_t row_end;
+} ConvertJob;
+
+static void ConvertPixelsScalar(const uint8_t *top, const uint8_t *bottom, uint8_t *y_top, uint8_t *y_bottom, uint8_t *u, uint8_t *v, size_t begin, size_t end)
+{
+    int r, g, b;
+
+    for (size_t x=begin; x < end; x += 2)
+    {
+        const uint8_t *p[4] = { top + 4 * x, top + 4 * (x + 1), bottom + 4 * x, bottom + 4 * (x + 1) };
+        uint8_t *luma[4] = { y_top + x, y_top + x + 1, y_bottom + x, y_bottom + x + 1 };
+
+        for (size_t i=0; i < 4; i++)
+            *luma[i] = ((66 * p[i][0] + 129 * p[i][1] + 25 * p[i][2] + 128) >> 8) + 16;
+
+        r = (p[0][0] + p[1][0] + p[2][0] + p[3][0] + 2) >> 2;
+        g = (p[0][1] + p[1][1] + p[2][1] + p[3][1] + 2) >> 2;
+        b = (p[0][2] + p[1][2] + p[2][2] + p[3][2] + 2) >> 2;
+        u[x / 2] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+        v[x / 2] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+    }
+}
+
+#ifdef __SSE2__
+// Dot product of four RGBA pixels with (c0, c1, c2, 0), as four int32.
+static __m128i DotRGBA4(__m128i pixels, __m128i coefficients)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128 low   = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpacklo_epi8(pixels, zero), coefficients));
+    __m128 high  = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpackhi_epi8(pixels, zero), coefficients));
+
+    return _mm_add_epi32(
+            _mm_castps_si128(_mm_shuffle_ps(low, high, _MM_SHUFFLE(2, 0, 2, 0))),
+            _mm_castps_si128(_mm_shuffle_ps(low, high, _MM_SHUFFLE(3, 1, 3, 1))));
+}
+
+static __m128i ConvertLuma16(const uint8_t *row)
+{
+    const __m128i coefficients = _mm_setr_epi16(66, 129, 25, 0, 66, 129, 25, 0);
+    const __m128i round = _mm_set1_epi32(128);
+    __m128i luma[4];
+
+    for (size_t i=0; i < 4; i++)
+        luma[i] = _mm_srai_epi32(_mm_add_epi32(DotRGBA4(_mm_loadu_si128((const __m128i *)(row + 16 * i)), coefficients), round), 8);
+
+    return _mm_add_epi8(
+            _mm_packus_epi16(_mm_packs_epi32(luma[0], luma[1]), _mm_packs_epi32(luma[2], luma[3])),
+            _mm_set1_epi8(16));
+}
+
+static __m128i ConvertChroma8(__m128i blocks[2], __m128i coefficients)
+{
+    const __m128i round = _mm_set1_epi32(128);
+    __m128i low  = _mm_srai_epi32(_mm_add_epi32(DotRGBA4(blocks[0], coefficients), round), 8);
+    __m128i high = _mm_srai_epi32(_mm_add_epi32(DotRGBA4(blocks[1], coefficients), round), 8);
+
+    return _mm_add_epi16(_mm_packs_epi32(low, high), _mm_set1_epi16(128));
+}
+
+static size_t ConvertPixelsSSE2(const uint8_t *top, const uint8_t *bottom, uint8_t *y_top, uint8_t *y_bottom, uint8_t *u, uint8_t *v, size_t width)
+{
+    const __m128i u_coefficients = _mm_setr_epi16(-38, -74, 112, 0, -38, -74, 112, 0);
+    const __m128i v_coefficients = _mm_setr_epi16(112, -94, -18, 0, 112, -94, -18, 0);
+    __m128i blocks[2];
+    __m128i averaged[4];
+    size_t x;
+
+    for (x=0; x + 16 <= width; x += 16)
+    {
+        _mm_storeu_si128((__m128i *)(y_top + x), ConvertLuma16(top + 4 * x));
+        _mm_storeu_si128((__m128i *)(y_bottom + x), ConvertLuma16(bottom + 4 * x));
+
+        // Average each 2x2 block: rows first, then neighbouring pixels.
+        for (size_t i=0; i < 4; i++)
+        {
+            averaged[i] = _mm_avg_epu8(
+                    _mm_loadu_si128((const __m128i *)(top + 4 * x + 16 * i)),
+                    _mm_loadu_si128((const __m128i *)(bottom + 4 * x + 16 * i)));
+            averaged[i] = _mm_avg_epu8(averaged[i], _mm_shuffle_epi32(averaged[i], _MM_SHUFFLE(2, 3, 0, 1)));
+            averaged[i] = _mm_shuffle_epi32(averaged[i], _MM_SHUFFLE(2, 0, 2, 0));
+        }
+        blocks[0] = _mm_unpacklo_epi64(averaged[0], averaged[1]);
+        blocks[1] = _mm_unpacklo_epi64(averaged[2], averaged[3]);
+
+        _mm_storel_epi64((__m128i *)(u + x / 2), _mm_packus_epi16(ConvertChroma8(blocks, u_coefficients), _mm_setzero_si128()));
+        _mm_storel_epi64((__m128i *)(v + x / 2), _mm_packus_epi16(ConvertChroma8(blocks, v_coefficients), _mm_setzero_si128()));
+    }
+
+    return x;
+}
+#endif
+
+static void *ConvertRows(void *arg)
+{
+    ConvertJob *job = (ConvertJob *)arg;
+    LibavEncoder *encoder = job->encoder;
+    AVFrame *frame = encoder->frame;
+    size_t stride = 4 * encoder->width;
+    size_t done;
+
+    // The GPU readback is bottom-up, so rows are flipped while converting.
+    for (size_t y=job->row_begin; y < job->row_end; y += 2)
+    {
+        const uint8_t *top    = encoder->data + (encoder->height - 1 - y) * stride;
+        const uint8_t *bottom = encoder->data + (encoder->height - 2 - y) * stride;
+        uint8_t *y_top    = frame->data[0] + y * frame->linesize[0];
+        uint8_t *y_bottom = frame->data[0] + (y + 1) * frame->linesize[0];
+        uint8_t *u        = frame->data[1] + (y / 2) * frame->linesize[1];
+        uint8_t *v        = frame->data[2] + (y / 2) * frame->linesize[2];
+
+        done = 0;
+#ifdef __SSE2__
+        done = ConvertPixelsSSE2(top, bottom, y_top, y_bottom, u, v, encoder->width);
+#endif
+        ConvertPixelsScalar(top, bottom, y_top, y_bottom, u, v, done, encoder->width);
+    }
+
+    return NULL;
+}
+
+// Conversion workers sleep until the generation changes, convert their band
+// of the new frame and report back through pending.
+static void *ConvertWorker(void *arg)
+{
+    ConvertJob *job = (ConvertJob *)arg;
+    LibavEncoder *encoder = job->encoder;
+    unsigned long generation = 0;
+
+    pthread_mutex_lock(&encoder->mutex);
+    while (true)
+    {
+        while (encoder->generation == generation && !encoder->closing)
+            pthread_cond_wait(&encoder->start, &encoder->mutex);
+        if (encoder->closing)
+            break;
+        generation = encoder->generation;
+        pthread_mutex_unlock(&encoder->mutex);
+
+        ConvertRows(job);
+
+        pthread_mutex_lock(&encoder->mutex);
+        if (--encoder->pending == 0)
+            pthread_cond_signal(&encoder->done);
+    }
+    pthread_mutex_unlock(&encoder->mutex);
+
+    return NULL;
+}
+
+static void DrainLibavEncoder(LibavEncoder *encoder)
+{
+    int result;
+
+    while ((result = avcodec_receive_packet(encoder->codec, encoder->packet)) == 0)
+    {
+        av_packet_rescale_ts(encoder->packet, encoder->codec->time_base, encoder->stream->time_base);
+        encoder->packet->stream_index = encoder->stream->index;
+        if ((result = av_interleaved_write_frame(encoder->format, encoder->packet)) < 0)
+        {
+            fprintf(stderr, "ERROR: Could not write an encoded packet: %s.\n", av_err2str(result));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (result != AVERROR(EAGAIN) && result != AVERROR_EOF)
+    {
+        fprintf(stderr, "ERROR: Could not receive an encoded packet: %s.\n", av_err2str(result));
+        exit(EXIT_FAILURE);
+    }
+}
+
+LibavEncoder *StartLibavEncoder(const size_t width, const size_t height, const size_t FPS, const char *output_dir, const char *name, const char *timestamp, EncoderSettings settings)
+{
+    if (width % 2 != 0 || height % 2 != 0)
+    {
+        fprintf(stderr, "ERROR: The libav encoder needs an even resolution, got %zux%zu.\n", width, height);
+        exit(EXIT_FAILURE);
+    }
+
+    mkdir(output_dir, S_IRWXU | S_IRWXG | S_IRWXO);
+
+    char time_buffer[TIMESTAMP_CAP];
+    const char *formated_time = FormatTimestamp(time_buffer, timestamp);
+
+    char str_output_name[OUTPUT_NAME_CAP];
+    char str_crf[FPS_CAP];
+    FormatOutputName(str_output_name, output_dir, formated_time, name, "mp4");
+    snprintf(str_crf, FPS_CAP, "%d", settings.crf);
+
+    const AVCodec *codec = avcodec_find_encoder_by_name(settings.codec);
+    if (codec == NULL)
+    {
+        fprintf(stderr, "ERROR: Could not find the '%s' encoder.\n", settings.codec);
+        exit(EXIT_FAILURE);
+    }
+
+    LibavEncoder *encoder = (LibavEncoder*)malloc(sizeof(LibavEncoder));
+    encoder->width           = width;
+    encoder->height          = height;
+    encoder->frame_index     = 0;
+    encoder->convert_threads = (settings.convert_threads > 0) ? settings.convert_threads : 1;
+
+    if (avformat_alloc_output_context2(&encoder->format, NULL, NULL, str_output_name) < 0)
+    {
+        fprintf(stderr, "ERROR: Could not create an output context for '%s'.\n", str_output_name);
+        exit(EXIT_FAILURE);
+    }
+
+    encoder->stream = avformat_new_stream(encoder->format, NULL);
+    encoder->codec  = avcodec_alloc_context3(codec);
+    encoder->codec->width        = width;
+    encoder->codec->height       = height;
+    encoder->codec->time_base    = (AVRational){ 1, FPS };
+    encoder->codec->framerate    = (AVRational){ FPS, 1 };
+    encoder->codec->pix_fmt      = AV_PIX_FMT_YUV420P;
+    encoder->codec->thread_count = settings.threads;
+    if (encoder->format->oformat->flags & AVFMT_GLOBALHEADER)
+        encoder->codec->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    av_opt_set(encoder->codec->priv_data, "preset", settings.preset, 0);
+    av_opt_set(encoder->codec->priv_data, "crf", str_crf, 0);
+
+    if (avcodec_open2(encoder->codec, codec, NULL) < 0)
+    {
+        fprintf(stderr, "ERROR: Could not open the '%s' encoder.\n", settings.codec);
+        exit(EXIT_FAILURE);
+    }
+
+    avcodec_parameters_from_context(encoder->stream->codecpar, encoder->codec);
+    encoder->stream->time_base = encoder->codec->time_base;
+
+    if (avio_open(&encoder->format->pb, str_output_name, AVIO_FLAG_WRITE) < 0 || avformat_write_header(encoder->format, NULL) < 0)
+    {
+        fprintf(stderr, "ERROR: Could not write to '%s'.\n", str_output_name);
+        exit(EXIT_FAILURE);
+    }
+
+    encoder->frame = av_frame_alloc();
+    encoder->frame->format = AV_PIX_FMT_YUV420P;
+    encoder->frame->width  = width;
+    encoder->frame->height = height;
+    if (av_frame_get_buffer(encoder->frame, 0) < 0)
+    {
+        fprintf(stderr, "ERROR: Could not allocate a %zux%zu frame.\n", width, height);
+        exit(EXIT_FAILURE);
+    }
+    encoder->packet = av_packet_alloc();
+
+    // Bands of row pairs, job 0 runs on the calling thread.
+    size_t row_pairs = height / 2;
+    encoder->jobs    = (ConvertJob *)malloc(sizeof(ConvertJob) * encoder->convert_threads);
+    encoder->threads = (pthread_t *)malloc(sizeof(pthread_t) * encoder->convert_threads);
+    encoder->generation = 0;
+    encoder->pending    = 0;
+    encoder->closing    = false;
+    pthread_mutex_init(&encoder->mutex, NULL);
+    pthread_cond_init(&encoder->start, NULL);
+    pthread_cond_init(&encoder->done, NULL);
+    for (int i=0; i < encoder->convert_threads; i++)
+    {
+        encoder->jobs[i].encoder   = encoder;
+        encoder->jobs[i].row_begin = 2 * (row_pairs * i / encoder->convert_threads);
+        encoder->jobs[i].row_end   = 2 * (row_pairs * (i + 1) / encoder->convert_threads);
+        if (i > 0)
+            pthread_create(&encoder->threads[i], NULL, ConvertWorker, &encoder->jobs[i]);
+    }
+
+    return encoder;
+}
+
+void FeedLibavEncoderInverted(LibavEncoder *encoder, void *data)
+{
+    int result;
+
+    if ((result = av_frame_make_writable(encoder->frame)) < 0)
+    {
+        fprintf(stderr, "ERROR: Could not make frame %lld writable: %s.\n", (long long)encoder->frame_index, av_err2str(result));
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_lock(&encoder->mutex);
+    encoder->data    = (const uint8_t *)data;
+    encoder->pending = encoder->convert_threads - 1;
+    encoder->generation++;
+    pthread_cond_broadcast(&encoder->start);
+    pthread_mutex_unlock(&encoder->mutex);
+
+    ConvertRows(&encoder->jobs[0]);
+
+    pthread_mutex_lock(&encoder->mutex);
+    while (encoder->pending > 0)
+        pthread_cond_wait(&encoder->done, &encoder->mutex);
+    pthread_mutex_unlock(&encoder->mutex);
+
+    encoder->frame->pts = encoder->frame_index++;
+    if ((result = avcodec_send_frame(encoder->codec, encoder->frame)) < 0)
+    {
+        fprintf(stderr, "ERROR: Could not encode frame %lld: %s.\n", (long long)encoder->frame->pts, av_err2str(result));
+        exit(EXIT_FAILURE);
+    }
+    DrainLibavEncoder(encoder);
+}
+
+void CloseLibavEncoder(LibavEncoder *encoder)
+{
+    int result;
+
+    pthread_mutex_lock(&encoder->mutex);
+    encoder->closing = true;
+    pthread_cond_broadcast(&encoder->start);
+    pthread_mutex_unlock(&encoder->mutex);
+    for (int i=1; i < encoder->convert_threads; i++)
+        pthread_join(encoder->threads[i], NULL);
+
+    if ((result = avcodec_send_frame(encoder->codec, NULL)) < 0)
+    {
+        fprintf(stderr, "ERROR: Could not flush the encoder: %s.\n", av_err2str(result));
+        exit(EXIT_FAILURE);
+    }
+    DrainLibavEncoder(encoder);
+    if ((result = av_write_trailer(encoder->format)) < 0)
+    {
+        fprintf(stderr, "ERROR: Could not finish the video: %s.\n", av_err2str(result));
+        exit(EXIT_FAILURE);
+    }
+
+    avio_closep(&encoder->format->pb);
+    avcodec_free_context(&encoder->codec);
+    av_frame_free(&encoder->frame);
+    av_packet_free(&encoder->packet);
+    avformat_free_context(encoder->format);
+    pthread_mutex_destroy(&encoder->mutex);
+    pthread_cond_destroy(&encoder->start);
+    pthread_cond_destroy(&encoder->done);
+    free(encoder->jobs);
+    free(encoder->threads);
+    free(encoder);
+}
+#endif
+
+#define RAW_CHUNK_MAGIC "PFSRAW1"
+
+static void WriteArchiveJob(FrameArchive *archive, ArchiveJob *job)
+{
+    char path[OUTPUT_NAME_CAP + 32];
+    size_t frame_size = 4 * archive->width * archive->height;
+
+    if (archive->backend == ENCODER_PNG_SEQUENCE)
+    {
+        Image image = { job->data, archive->width, archive->height, 1, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8 };
+        snprintf(path, sizeof(path), "%s/frame_%06zu.png", archive->directory, job->index);
+        if (!ExportImage(image, path))
+            fprintf(stderr, "ERROR: Could not write '%s'.\n", path);
+        return;
+    }
+
+    // Chunk layout: magic, width, height, frame count, compression, payload size, payload.
+    const void *payload = job->data;
+    uint64_t payload_size = frame_size * job->frames;
+    uint32_t header[4] = { archive->width, archive->height, job->frames, 0 };
+
+#ifdef SIMLIB_ZSTD
+    size_t bound = ZSTD_compressBound(payload_size);
+    void *compressed = malloc(bound);
+    size_t compressed_size = ZSTD_compress(compressed, bound, job->data, payload_size, archive->compression_level);
+    if (!ZSTD_isError(compressed_size))
+    {
+        payload = compressed;
+        payload_size = compressed_size;
+        header[3] = 1;
+    }
+    snprintf(path, sizeof(path), "%s/chunk_%05zu.raw.zst", archive->directory, job->index);
+#else
+    snprintf(path, sizeof(path), "%s/chunk_%05zu.raw", archive->directory, job->index);
+#endif
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+        fprintf(stderr, "ERROR: Could not open '%s': %s\n", path, strerror(errno));
+    else
+    {
+        fwrite(RAW_CHUNK_MAGIC, 1, sizeof(RAW_CHUNK_MAGIC), file);
+        fwrite(header, sizeof(uint32_t), 4, file);
+        fwrite(&payload_size, sizeof(uint64_t), 1, file);
+        fwrite(payload, 1, payload_size, file);
+        fclose(file);
+    }
+
+#ifdef SIMLIB_ZSTD
+    free(compressed);
+#endif
+}
+
+static void *RunArchiveWorker(void *arg)
+{
+    FrameArchive *archive = (FrameArchive *)arg;
+    ArchiveJob *job;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&archive->mutex);
+        while (archive->queue_head == NULL && !archive->closing)
+            pthread_cond_wait(&archive->not_empty, &archive->mutex);
+
+        if ((job = archive->queue_head) == NULL)
+        {
+            pthread_mutex_unlock(&archive->mutex);
+            return NULL;
+        }
+
+        archive->queue_head = job->next;
+        if (archive->queue_head == NULL)
+            archive->queue_tail = NULL;
+        pthread_mutex_unlock(&archive->mutex);
+
+        WriteArchiveJob(archive, job);
+        free(job->data);
+
+        pthread_mutex_lock(&archive->mutex);
+        archive->memory_used -= job->bytes;
+        pthread_cond_signal(&archive->memory_freed);
+        pthread_mutex_unlock(&archive->mutex);
+        free(job);
+    }
+}
+
+// Blocks the render thread until the job fits, a single job larger than the
+// limit still goes through alone.
+static void ReserveArchiveMemory(FrameArchive *archive, size_t bytes)
+{
+    pthread_mutex_lock(&archive->mutex);
+    while (archive->memory_used > 0 && archive->memory_used + bytes > archive->memory_limit)
+        pthread_cond_wait(&archive->memory_freed, &archive->mutex);
+    archive->memory_used += bytes;
+    pthread_mutex_unlock(&archive->mutex);
+}
+
+static size_t ArchiveJobBytes(FrameArchive *archive, size_t frames)
+{
+    size_t bytes = 4 * archive->width * archive->height * frames;
+#ifdef SIMLIB_ZSTD
+    // The worker holds the compressed copy next to the frames.
+    bytes += ZSTD_compressBound(bytes);
+#endif
+    return bytes;
+}
+
+static void SubmitArchiveJob(FrameArchive *archive, ArchiveJob *job)
+{
+    pthread_mutex_lock(&archive->mutex);
+    job->next = NULL;
+    if (archive->queue_tail != NULL)
+        archive->queue_tail->next = job;
+    else
+        archive->queue_head = job;
+    archive->queue_tail = job;
+
+    pthread_cond_signal(&archive->not_empty);
+    pthread_mutex_unlock(&archive->mutex);
+}
+
+FrameArchive *StartFrameArchive(EncoderSettings settings, const size_t width, const size_t height, const char *output_dir, const char *name, const char *timestamp)
+{
+    mkdir(output_dir, S_IRWXU | S_IRWXG | S_IRWXO);
+
+    char time_buffer[TIMESTAMP_CAP];
+    const char *formated_time = FormatTimestamp(time_buffer, timestamp);
+
+    FrameArchive *archive = (FrameArchive*)malloc(sizeof(FrameArchive));
+    if (name != NULL && name[0] != '\0')
+        snprintf(archive->directory, OUTPUT_NAME_CAP, "%s/%s %s", output_dir, formated_time, name);
+    else
+        snprintf(archive->directory, OUTPUT_NAME_CAP, "%s/%s", output_dir, formated_time);
+
+    if (mkdir(archive->directory, S_IRWXU | S_IRWXG | S_IRWXO) < 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "ERROR: Could not create '%s': %s\n", archive->directory, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    archive->backend           = settings.backend;
+    archive->width             = width;
+    archive->height            = height;
+    archive->frame_index       = 0;
+    archive->chunk_index       = 0;
+    archive->chunk_frames      = (settings.chunk_frames > 0) ? settings.chunk_frames : 1;
+    archive->compression_level = settings.compression_level;
+    archive->current           = NULL;
+    archive->queue_head        = NULL;
+    archive->queue_tail        = NULL;
+    archive->memory_used       = 0;
+    archive->memory_limit      = (size_t)((settings.archive_memory > 0) ? settings.archive_memory : 1) << 20;
+    archive->closing           = false;
+    archive->threads_size      = (settings.threads > 0) ? settings.threads : sysconf(_SC_NPROCESSORS_ONLN);
+
+    // Short enough chunks that every worker and the render thread can hold one.
+    size_t chunk_frames = archive->memory_limit / ((archive->threads_size + 1) * ArchiveJobBytes(archive, 1));
+    chunk_frames = (chunk_frames < 1) ? 1 : chunk_frames;
+    if (archive->backend != ENCODER_PNG_SEQUENCE && chunk_frames < archive->chunk_frames)
+    {
+        printf("NOTE: Raw chunks lowered to %zu frames to stay within %d MiB.\n", chunk_frames, settings.archive_memory);
+        archive->chunk_frames = chunk_frames;
+    }
+
+    pthread_mutex_init(&archive->mutex, NULL);
+    pthread_cond_init(&archive->not_empty, NULL);
+    pthread_cond_init(&archive->memory_freed, NULL);
+
+    archive->threads = (pthread_t*)malloc(sizeof(pthread_t) * archive->threads_size);
+    for (int i=0; i < archive->threads_size; i++)
+        pthread_create(&archive->threads[i], NULL, RunArchiveWorker, archive);
+
+    return archive;
+}
+
+void FeedFrameArchiveInverted(FrameArchive *archive, void *data)
+{
+    size_t stride = 4 * archive->width;
+    size_t frames = (archive->backend == ENCODER_PNG_SEQUENCE) ? 1 : archive->chunk_frames;
+
+    if (archive->current == NULL)
+    {
+        ReserveArchiveMemory(archive, ArchiveJobBytes(archive, frames));
+        archive->current = (ArchiveJob*)malloc(sizeof(ArchiveJob));
+        archive->current->index  = (archive->backend == ENCODER_PNG_SEQUENCE) ? archive->frame_index : archive->chunk_index++;
+        archive->current->frames = 0;
+        archive->current->bytes  = ArchiveJobBytes(archive, frames);
+        archive->current->data   = (uint8_t*)malloc(stride * archive->height * frames);
+    }
+
+    // The copy is the only work done on the render thread.
+    uint8_t *frame = archive->current->data + stride * archive->height * archive->current->frames;
+    for (size_t y=0; y < archive->height; y++)
+        memcpy(frame + y * stride, (uint8_t*)data + (archive->height - 1 - y) * stride, stride);
+
+    archive->frame_index++;
+    if (++archive->current->frames == frames)
+    {
+        SubmitArchiveJob(archive, archive->current);
+        archive->current = NULL;
+    }
+}
+
+void CloseFrameArchive(FrameArchive *archive)
+{
+    if (archive->current != NULL)
+        SubmitArchiveJob(archive, archive->current);
+
+    pthread_mutex_lock(&archive->mutex);
+    archive->closing = true;
+    pthread_cond_broadcast(&archive->not_empty);
+    pthread_mutex_unlock(&archive->mutex);
+
+    for (int i=0; i < archive->threads_size; i++)
+        pthread_join(archive->threads[i], NULL);
+
+    pthread_mutex_destroy(&archive->mutex);
+    pthread_cond_destroy(&archive->not_empty);
+    pthread_cond_destroy(&archive->memory_freed);
+    free(archive->threads);
+    free(archive);
+}
+
+Encoder *StartEncoder(EncoderSettings settings, const size_t width, const size_t height, const size_t FPS, const char *output_dir, const char *name, const char *timestamp)
+{
+    Encoder *encoder = (Encoder*)malloc(sizeof(Encoder));
+    encoder->backend = settings.backend;
+
+    switch (settings.backend)
+    {
+        case ENCODER_FFMPEG_PIPE:
+            encoder->ffmpeg = StartFFMPEGProcess(width, height, FPS, output_dir, name, timestamp, "quiet", settings);
+            break;
+
+        case ENCODER_LIBAV:
+#ifdef SIMLIB_LIBAV
+            encoder->libav = StartLibavEncoder(width, height, FPS, output_dir, name, timestamp, settings);
+            break;
+#else
+            fprintf(stderr, "ERROR: simlib was built without libav support, rebuild with -DSIMLIB_LIBAV.\n");
+            exit(EXIT_FAILURE);
+#endif
+
+        case ENCODER_PNG_SEQUENCE:
+        case ENCODER_RAW_CHUNKS:
+            encoder->archive = StartFrameArchive(settings, width, height, output_dir, name, timestamp);
+            break;
+    }
+
+    return encoder;
+}
+
+void FeedEncoderInverted(Encoder *encoder, void *data)
+{
+    switch (encoder->backend)
+    {
+        case ENCODER_FFMPEG_PIPE:
+            FeedFFMPEGInverted(encoder->ffmpeg, data);
+            break;
+
+        case ENCODER_LIBAV:
+#ifdef SIMLIB_LIBAV
+            FeedLibavEncoderInverted(encoder->libav, data);
+#endif
+            break;
+
+        case ENCODER_PNG_SEQUENCE:
+        case ENCODER_RAW_CHUNKS:
+            FeedFrameArchiveInverted(encoder->archive, data);
+            break;
+    }
+}
+
+void CloseEncoder(Encoder *encoder)
+{
+    switch (encoder->backend)
+    {
+        case ENCODER_FFMPEG_PIPE:
+            CloseFFMPEG(encoder->ffmpeg);
+            break;
+
+        case ENCODER_LIBAV:
+#ifdef SIMLIB_LIBAV
+            CloseLibavEncoder(encoder->libav);
+#endif
+            break;
+
+        case ENCODER_PNG_SEQUENCE:
+        case ENCODER_RAW_CHUNKS:
+            CloseFrameArchive(encoder->archive);
+            break;
+    }
+
+    free(encoder);
+}
+
+
+static const char *particle_vertex_shader =
+    "#version 330\n"
+    "in vec2 vertexCorner;\n"
+    "in vec4 instanceParticle;\n"
+    "uniform mat4 mvp;\n"
+    "uniform float scale;\n"
+    "uniform float radius;\n"
+    "uniform vec2 speedRange;\n"
+    "out vec2 fragCorner;\n"
+    "out vec4 fragColor;\n"
+    "void main()\n"
+    "{\n"
+    "    float speed = dot(instanceParticle.zw, instanceParticle.zw);\n"
+    "    float alpha = clamp((speed - speedRange.x) / speedRange.y, 0.0, 1.0);\n"
+    "    fragCorner = vertexCorner;\n"
+    "    fragColor = vec4(alpha, 0.0, 1.0 - alpha, alpha);\n"
+    "    gl_Position = mvp * vec4(instanceParticle.xy * scale + vertexCorner * radius, 0.0, 1.0);\n"
+    "}\n";
+
+static const char *particle_fragment_shader =
+    "#version 330\n"
+    "in vec2 fragCorner;\n"
+    "in vec4 fragColor;\n"
+    "out vec4 finalColor;\n"
+    "void main()\n"
+    "{\n"
+    "    if (dot(fragCorner, fragCorner) > 1.0)\n"
+    "        discard;\n"
+    "    finalColor = fragColor;\n"
+    "}\n";
+
+static void LoadParticleInstanceBuffer(ParticleRenderer *renderer, size_t capacity)
+{
+    rlEnableVertexArray(renderer->vao);
+
+    if (renderer->instance_vbo != 0)
+        rlUnloadVertexBuffer(renderer->instance_vbo);
+
+    renderer->capacity     = capacity;
+    renderer->instance_vbo = rlLoadVertexBuffer(NULL, sizeof(float) * 4 * capacity, true);
+    rlSetVertexAttribute(renderer->particle_location, 4, RL_FLOAT, false, sizeof(float) * 4, 0);
+    rlEnableVertexAttribute(renderer->particle_location);
+    rlSetVertexAttributeDivisor(renderer->particle_location, 1);
+
+    rlDisableVertexArray();
+}
+
+ParticleRenderer *LoadParticleRenderer(size_t capacity)
+{
+    const float corners[12] = {
+        -1.0f, -1.0f,   1.0f, -1.0f,   1.0f,  1.0f,
+        -1.0f, -1.0f,   1.0f,  1.0f,  -1.0f,  1.0f
+    };
+
+    ParticleRenderer *renderer = (ParticleRenderer*)malloc(sizeof(ParticleRenderer));
+    renderer->shader               = LoadShaderFromMemory(particle_vertex_shader, particle_fragment_shader);
+    renderer->corner_location      = GetShaderLocationAttrib(renderer->shader, "vertexCorner");
+    renderer->particle_location    = GetShaderLocationAttrib(renderer->shader, "instanceParticle");
+    renderer->mvp_location         = GetShaderLocation(renderer->shader, "mvp");
+    renderer->scale_location       = GetShaderLocation(renderer->shader, "scale");
+    renderer->radius_location      = GetShaderLocation(renderer->shader, "radius");
+    renderer->speed_range_location = GetShaderLocation(renderer->shader, "speedRange");
+
+    renderer->vao = rlLoadVertexArray();
+    rlEnableVertexArray(renderer->vao);
+    renderer->quad_vbo = rlLoadVertexBuffer(corners, sizeof(corners), false);
+    rlSetVertexAttribute(renderer->corner_location, 2, RL_FLOAT, false, 0, 0);
+    rlEnableVertexAttribute(renderer->corner_location);
+    rlDisableVertexArray();
+
+    renderer->instance_vbo = 0;
+    LoadParticleInstanceBuffer(renderer, capacity);
+    return renderer;
+}
+
+void DrawParticlesInstanced(ParticleRenderer *renderer, const void *particles, size_t count, float scale, float radius, float min_speed, float max_speed)
+{
+    if (count == 0)
+        return;
+
+    if (count > renderer->capacity)
+        LoadParticleInstanceBuffer(renderer, count * 2);
+
+    // Anything batched so far has to land before the custom draw call.
+    rlDrawRenderBatchActive();
+    rlUpdateVertexBuffer(renderer->instance_vbo, particles, sizeof(float) * 4 * count, 0);
+
+    Vector2 speed_range = { min_speed, max_speed };
+    rlEnableShader(renderer->shader.id);
+    rlSetUniformMatrix(renderer->mvp_location, MatrixMultiply(rlGetMatrixModelview(), rlGetMatrixProjection()));
+    rlSetUniform(renderer->scale_location, &scale, RL_SHADER_UNIFORM_FLOAT, 1);
+    rlSetUniform(renderer->radius_location, &radius, RL_SHADER_UNIFORM_FLOAT, 1);
+    rlSetUniform(renderer->speed_range_location, &speed_range, RL_SHADER_UNIFORM_VEC2, 1);
+
+    rlEnableVertexArray(renderer->vao);
+    rlDrawVertexArrayInstanced(0, 6, count);
+    rlDisableVertexArray();
+    rlDisableShader();
+}
+
+void UnloadParticleRenderer(ParticleRenderer *renderer)
+{
+    rlUnloadVertexBuffer(renderer->instance_vbo);
+    rlUnloadVertexBuffer(renderer->quad_vbo);
+    rlUnloadVertexArray(renderer->vao);
+    UnloadShader(renderer->shader);
+    free(renderer);
+}
+
+
+FramePipeline *CreateFramePipeline(void *front, void *back)
+{
+    FramePipeline *pipeline = (FramePipeline*)malloc(sizeof(FramePipeline));
+    pipeline->slots[0]    = front;
+    pipeline->slots[1]    = back;
+    pipeline->write_index = 0;
+    pipeline->read_index  = 0;
+    atomic_init(&pipeline->full[0], 0);
+    atomic_init(&pipeline->full[1], 0);
+    atomic_init(&pipeline->stopped, false);
+    pthread_mutex_init(&pipeline->mutex, NULL);
+    pthread_cond_init(&pipeline->changed, NULL);
+    return pipeline;
+}
+
+// Spins for a short while, since the other side is usually about to hand the
+// slot over, then sleeps until it does. Returns false once stopped.
+static bool WaitFramePipeline(FramePipeline *pipeline, size_t index, int full)
+{
+    for (int i=0; i < FRAME_PIPELINE_SPINS; i++)
+    {
+        if (atomic_load_explicit(&pipeline->full[index], memory_order_acquire) == full)
+            return true;
+        if (atomic_load_explicit(&pipeline->stopped, memory_order_relaxed))
+            return false;
+        sched_yield();
+    }
+
+    pthread_mutex_lock(&pipeline->mutex);
+    while (atomic_load_explicit(&pipeline->full[index], memory_order_acquire) != full &&
+            !atomic_load_explicit(&pipeline->stopped, memory_order_relaxed))
+        pthread_cond_wait(&pipeline->changed, &pipeline->mutex);
+    pthread_mutex_unlock(&pipeline->mutex);
+
+    return atomic_load_explicit(&pipeline->full[index], memory_order_acquire) == full;
+}
+
+// Taking the mutex orders the wakeup after a waiter's last check of the flag.
+static void WakeFramePipeline(FramePipeline *pipeline)
+{
+    pthread_mutex_lock(&pipeline->mutex);
+    pthread_cond_broadcast(&pipeline->changed);
+    pthread_mutex_unlock(&pipeline->mutex);
+}
+
+void *AcquireWriteFrame(FramePipeline *pipeline)
+{
+    if (!WaitFramePipeline(pipeline, pipeline->write_index, 0))
+        return NULL;
+
+    return pipeline->slots[pipeline->write_index];
+}
+
+void PublishWriteFrame(FramePipeline *pipeline)
+{
+    atomic_store_explicit(&pipeline->full[pipeline->write_index], 1, memory_order_release);
+    pipeline->write_index ^= 1;
+    WakeFramePipeline(pipeline);
+}
+
+void *AcquireReadFrame(FramePipeline *pipeline)
+{
+    if (!WaitFramePipeline(pipeline, pipeline->read_index, 1))
+        return NULL;
+
+    return pipeline->slots[pipeline->read_index];
+}
+
+void ReleaseReadFrame(FramePipeline *pipeline)
+{
+    atomic_store_explicit(&pipeline->full[pipeline->read_index], 0, memory_order_release);
+    pipeline->read_index ^= 1;
+    WakeFramePipeline(pipeline);
+}
+
+void StopFramePipeline(FramePipeline *pipeline)
+{
+    atomic_store_explicit(&pipeline->stopped, true, memory_order_relaxed);
+    WakeFramePipeline(pipeline);
+}
+
+void CloseFramePipeline(FramePipeline *pipeline)
+{
+    pthread_mutex_destroy(&pipeline->mutex);
+    pthread_cond_destroy(&pipeline->changed);
+    free(pipeline);
+}
+
+
+// Every name looked up so far, which CheckOptions accepts.
+static const char *known_options[OPTIONS_CAP];
+static size_t known_options_size = 0;
+
+static const char *FindOption(int argc, char **argv, int *index, const char *name)
+{
+    size_t length = strlen(name);
+    const char *arg;
+    size_t i;
+
+    for (i=0; i < known_options_size && strcmp(known_options[i], name) != 0; i++);
+    if (i == known_options_size && known_options_size < OPTIONS_CAP)
+        known_options[known_options_size++] = name;
+
+    for (; *index < argc; (*index)++)
+    {
+        arg = argv[*index];
+        if (strncmp(arg, "--", 2) != 0 || strncmp(arg + 2, name, length) != 0)
+            continue;
+
+        // --name=value
+        if (arg[2 + length] == '=')
+        {
+            (*index)++;
+            return arg + 3 + length;
+        }
+        if (arg[2 + length] != '\0')
+            continue;
+
+        // --name value, or a bare --name flag.
+        (*index)++;
+        if (*index < argc && strncmp(argv[*index], "--", 2) != 0)
+            return argv[(*index)++];
+        return "";
+    }
+
+    return NULL;
+}
+
+// Looks up --name=value or --name value on the command line, the last one
+// winning, then falls back to the env variable. Returns NULL when neither is
+// set and "" for a bare flag.
+const char *GetOption(int argc, char **argv, const char *name, const char *env)
+{
+    const char *value = NULL;
+    const char *found;
+    int index = 1;
+
+    while ((found = FindOption(argc, argv, &index, name)) != NULL)
+        value = found;
+
+    if (value == NULL && env != NULL)
+        value = getenv(env);
+
+    return value;
+}
+
+int GetOptionInt(int argc, char **argv, const char *name, const char *env, int fallback)
+{
+    const char *value = GetOption(argc, argv, name, env);
+    char end;
+    int result;
+
+    if (value == NULL)
+        return fallback;
+
+    if (sscanf(value, "%d%c", &result, &end) != 1)
+    {
+        fprintf(stderr, "ERROR: '%s' is not a valid integer for --%s.\n", value, name);
+        exit(EXIT_FAILURE);
+    }
+
+    return result;
+}
+
+float GetOptionFloat(int argc, char **argv, const char *name, const char *env, float fallback)
+{
+    const char *value = GetOption(argc, argv, name, env);
+    char end;
+    float result;
+
+    if (value == NULL)
+        return fallback;
+
+    if (sscanf(value, "%f%c", &result, &end) != 1)
+    {
+        fprintf(stderr, "ERROR: '%s' is not a valid number for --%s.\n", value, name);
+        exit(EXIT_FAILURE);
+    }
+
+    return result;
+}
+
+bool GetOptionBool(int argc, char **argv, const char *name, const char *env, bool fallback)
+{
+    const char *value = GetOption(argc, argv, name, env);
+
+    if (value == NULL)
+        return fallback;
+
+    if (strcmp(value, "") == 0 || strcmp(value, "1") == 0 || strcmp(value, "true") == 0 || strcmp(value, "yes") == 0)
+        return true;
+    if (strcmp(value, "0") == 0 || strcmp(value, "false") == 0 || strcmp(value, "no") == 0)
+        return false;
+
+    fprintf(stderr, "ERROR: '%s' is not a valid boolean for --%s.\n", value, name);
+    exit(EXIT_FAILURE);
+}
+
+void CheckOptions(int argc, char **argv)
+{
+    const char *arg;
+    size_t length;
+    size_t i;
+
+    for (int index=1; index < argc; index++)
+    {
+        arg = argv[index];
+        if (strncmp(arg, "--", 2) != 0)
+        {
+            fprintf(stderr, "ERROR: Unexpected argument '%s', see --help.\n", arg);
+            exit(EXIT_FAILURE);
+        }
+
+        length = strcspn(arg + 2, "=");
+        for (i=0; i < known_options_size; i++)
+            if (strlen(known_options[i]) == length && strncmp(known_options[i], arg + 2, length) == 0)
+                break;
+        if (i == known_options_size)
+        {
+            fprintf(stderr, "ERROR: Unknown option '%.*s', see --help.\n", (int)length + 2, arg);
+            exit(EXIT_FAILURE);
+        }
+
+        // --name value, the same way FindOption reads it.
+        if (arg[2 + length] == '\0' && index + 1 < argc && strncmp(argv[index + 1], "--", 2) != 0)
+            index++;
+    }
+}
+
+void PrintSimulationUsage(FILE *stream)
+{
+    fprintf(stream,
+            "Simulation options (environment variable in brackets):\n"
+            "  --mode=run|render|both          [PFS_MODE]              default render\n"
+            "  --width=N --height=N            [PFS_WIDTH, PFS_HEIGHT] default 1920x1080\n"
+            "  --fps=N                         [PFS_FPS]               default 60\n"
+            "  --duration=SECONDS              [PFS_DURATION]          default 2.5, render mode only\n"
+            "  --hidden                        [PFS_HIDDEN]            no visible window, for headless renders\n"
+            "  --layers=LAYERS                 [PFS_LAYERS]            layers of the main output, default particles+walls\n"
+            "  --output=NAME:WxH[:LAYERS]      [PFS_OUTPUTS]           extra output, repeatable, comma separated in env\n"
+            "  --output-dir=DIR                [PFS_OUTPUT_DIR]        default videos\n"
+            "  --encoder=ffmpeg|libav|png|raw  [PFS_ENCODER]           default ffmpeg\n"
+            "  --codec=NAME --preset=NAME      [PFS_CODEC, PFS_PRESET] default libx264, medium\n"
+            "  --crf=N                         [PFS_CRF]               default 23\n"
+            "  --encoder-threads=N             [PFS_ENCODER_THREADS]   per output, default the cores split between outputs\n"
+            "  --convert-threads=N             [PFS_CONVERT_THREADS]   default 4\n"
+            "  --chunk-frames=N                [PFS_CHUNK_FRAMES]      raw chunks only, default 16\n"
+            "  --compression-level=N           [PFS_COMPRESSION_LEVEL] zstd level of raw chunks, default 3\n"
+            "  --archive-memory=MIB            [PFS_ARCHIVE_MEMORY]    raw and png frames in flight, default 1024\n"
+            "LAYERS is a '+' separated list of particles, walls and pressure.\n"
+            "NOTE: when the target resolution does not match the monitor resolution it will be scaled.\n");
+}
+
+static unsigned int ParseOverlays(const char *value, const char *option)
+{
+    unsigned int overlays = 0;
+    const char *layer = value;
+    size_t length;
+
+    while (*layer != '\0')
+    {
+        length = strcspn(layer, "+");
+        if (length == 9 && strncmp(layer, "particles", length) == 0)
+            overlays |= OVERLAY_PARTICLES;
+        else if (length == 5 && strncmp(layer, "walls", length) == 0)
+            overlays |= OVERLAY_WALLS;
+        else if (length == 8 && strncmp(layer, "pressure", length) == 0)
+            overlays |= OVERLAY_PRESSURE;
+        else
+        {
+            fprintf(stderr, "ERROR: '%.*s' is not a valid layer for --%s.\n", (int)length, layer, option);
+            exit(EXIT_FAILURE);
+        }
+
+        layer += length;
+        if (*layer == '+')
+            layer++;
+    }
+
+    return overlays;
+}
+
+// NAME:WIDTHxHEIGHT[:LAYERS]
+static void ParseRenderOutputConfig(SimulationState *sim_state, const char *spec, size_t length)
+{
+    RenderOutputConfig *config;
+    char buffer[OUTPUT_NAME_CAP];
+    char *layers;
+    char *size;
+
+    // Output 0 is the main one, made from --width and --height.
+    if (sim_state->output_configs_size + 1 == OUTPUTS_CAP)
+    {
+        fprintf(stderr, "ERROR: Can not add more than %d render outputs.\n", OUTPUTS_CAP);
+        exit(EXIT_FAILURE);
+    }
+
+    snprintf(buffer, OUTPUT_NAME_CAP, "%.*s", (int)length, spec);
+    config = &sim_state->output_configs[sim_state->output_configs_size];
+    config->overlays = OVERLAY_PARTICLES | OVERLAY_WALLS;
+
+    size = strchr(buffer, ':');
+    if (size == NULL || size == buffer)
+    {
+        fprintf(stderr, "ERROR: '%s' is not a valid output, expected NAME:WIDTHxHEIGHT[:LAYERS].\n", buffer);
+        exit(EXIT_FAILURE);
+    }
+    *size++ = '\0';
+
+    layers = strchr(size, ':');
+    if (layers != NULL)
+    {
+        *layers++ = '\0';
+        config->overlays = ParseOverlays(layers, "output");
+    }
+
+    if (sscanf(size, "%dx%d", &config->width, &config->height) != 2 || config->width <= 0 || config->height <= 0)
+    {
+        fprintf(stderr, "ERROR: '%s' is not a valid output size, expected WIDTHxHEIGHT.\n", size);
+        exit(EXIT_FAILURE);
+    }
+
+    if (strlen(buffer) >= TITLE_CAP)
+    {
+        fprintf(stderr, "ERROR: Output name '%s' is longer than %d characters.\n", buffer, TITLE_CAP - 1);
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(config->name, buffer, strlen(buffer) + 1);
+    sim_state->output_configs_size++;
+}
 
 void CreateSimulationState(SimulationState *sim_state, enum Mode mode, int target_resolution_width, int target_resolution_height, int fps, int duration)
 {
@@ -96,74 +1347,124 @@ void CreateSimulationState(SimulationState *sim_state, enum Mode mode, int targe
     sim_state->fps = fps;
     sim_state->dt = 1.0f / (float)fps;
     sim_state->duration = duration;
+    sim_state->hidden = false;
+    sim_state->overlays = OVERLAY_PARTICLES | OVERLAY_WALLS;
+    snprintf(sim_state->output_dir, OUTPUT_NAME_CAP, "videos");
+    sim_state->output_configs_size = 0;
     sim_state->loading_bar_size = (Vector2){ 300.0f, 50.0f };
     sim_state->loading_bar_offset = 10.0f;
     sim_state->percentage_font_size = 50.0f;
+    sim_state->encoder_settings = DefaultEncoderSettings();
 }
 
+// Every setting is read from --name=value on the command line first, then
+// from its PFS_* environment variable, then falls back to the default. See
+// PrintSimulationUsage for the full list.
 void ParseSimulationState(SimulationState *sim_state, int argc, char **argv)
 {
-    if (argc < 5 || argc > 6)
-    {
-        fprintf(stderr, "ERROR: Please provide the simulation mode, resolution and FPS and duration if 'render' mode is set. (mode, width, height, FPS, duration [render])\n");
-        printf("NOTE: with the target resolution does not match the monitor resolution it will be scaled.\n");
-        exit(EXIT_FAILURE);
-    }
-    
-    if (strcmp(argv[1], "run") == 0)
-        sim_state->mode = RUN;
-    else if (strcmp(argv[1], "render") == 0)
+    EncoderSettings *settings = &sim_state->encoder_settings;
+    const char *value;
+    const char *next;
+    int index;
+
+    CreateSimulationState(sim_state, RENDER, 1920, 1080, 60, 0);
+
+    value = GetOption(argc, argv, "mode", "PFS_MODE");
+    if (value == NULL || strcmp(value, "render") == 0)
         sim_state->mode = RENDER;
-    else if (strcmp(argv[1], "both") == 0)
+    else if (strcmp(value, "run") == 0)
+        sim_state->mode = RUN;
+    else if (strcmp(value, "both") == 0)
         sim_state->mode = BOTH;
     else
     {
-        fprintf(stderr, "ERROR: '%s' is not a valid mode.\n", argv[1]);
+        fprintf(stderr, "ERROR: '%s' is not a valid mode.\n", value);
         exit(EXIT_FAILURE);
     } 
-    
-    if (sscanf(argv[2], "%d", &sim_state->target_resolution_width) != 1)
+
+    sim_state->target_resolution_width  = GetOptionInt(argc, argv, "width", "PFS_WIDTH", sim_state->target_resolution_width);
+    sim_state->target_resolution_height = GetOptionInt(argc, argv, "height", "PFS_HEIGHT", sim_state->target_resolution_height);
+    if (sim_state->target_resolution_width <= 0 || sim_state->target_resolution_height <= 0)
     {
-        fprintf(stderr, "ERROR: '%s' is not a valid width.\n", argv[2]);
+        fprintf(stderr, "ERROR: %dx%d is not a valid resolution.\n", sim_state->target_resolution_width, sim_state->target_resolution_height);
         exit(EXIT_FAILURE);
     }
-    if (sscanf(argv[3], "%d", &sim_state->target_resolution_height) != 1)
+
+    sim_state->fps = GetOptionInt(argc, argv, "fps", "PFS_FPS", sim_state->fps);
+    if (sim_state->fps <= 0)
     {
-        fprintf(stderr, "ERROR: '%s' is not a valid height.\n", argv[3]);
+        fprintf(stderr, "ERROR: '%d' is not a valid FPS.\n", sim_state->fps);
         exit(EXIT_FAILURE);
     }
-    if (sscanf(argv[4], "%d", &sim_state->fps) != 1)
+    sim_state->dt = 1.0f / (float)sim_state->fps;
+
+    sim_state->duration = GetOptionFloat(argc, argv, "duration", "PFS_DURATION", 2.5f);
+    if (sim_state->mode == RENDER && sim_state->duration <= 0.0f)
     {
-        fprintf(stderr, "ERROR: '%s' is not a valid FPS.\n", argv[4]);
+        fprintf(stderr, "ERROR: '%f' is not a valid duration.\n", sim_state->duration);
         exit(EXIT_FAILURE);
     }
-    
-    if (sim_state->mode == RENDER && argc == 6)
-    {
-        if (sscanf(argv[5], "%f", &sim_state->duration) != 1)
+
+    sim_state->hidden = GetOptionBool(argc, argv, "hidden", "PFS_HIDDEN", false);
+
+    if ((value = GetOption(argc, argv, "layers", "PFS_LAYERS")) != NULL)
+        sim_state->overlays = ParseOverlays(value, "layers");
+
+    if ((value = GetOption(argc, argv, "output-dir", "PFS_OUTPUT_DIR")) != NULL)
+        snprintf(sim_state->output_dir, OUTPUT_NAME_CAP, "%s", value);
+
+    // Every --output adds one, PFS_OUTPUTS is only read without any.
+    index = 1;
+    while ((value = FindOption(argc, argv, &index, "output")) != NULL)
+        ParseRenderOutputConfig(sim_state, value, strlen(value));
+    if (sim_state->output_configs_size == 0 && (value = getenv("PFS_OUTPUTS")) != NULL)
+        for (; *value != '\0'; value = (*next == ',') ? next + 1 : next)
         {
-            fprintf(stderr, "ERROR: '%s' is not a valid duration.\n", argv[4]);
-            exit(EXIT_FAILURE);
+            next = value + strcspn(value, ",");
+            if (next > value)
+                ParseRenderOutputConfig(sim_state, value, next - value);
         }
-    } else if (sim_state->mode != RENDER && argc == 6)
+
+    value = GetOption(argc, argv, "encoder", "PFS_ENCODER");
+    if (value == NULL || strcmp(value, "ffmpeg") == 0)
+        settings->backend = ENCODER_FFMPEG_PIPE;
+    else if (strcmp(value, "libav") == 0)
+        settings->backend = ENCODER_LIBAV;
+    else if (strcmp(value, "png") == 0)
+        settings->backend = ENCODER_PNG_SEQUENCE;
+    else if (strcmp(value, "raw") == 0)
+        settings->backend = ENCODER_RAW_CHUNKS;
+    else
     {
-        fprintf(stderr, "ERROR: Too many arguments provide. Expected the following arguments: width, height, FPS.\n");
+        fprintf(stderr, "ERROR: '%s' is not a valid encoder.\n", value);
         exit(EXIT_FAILURE);
-    } else if (sim_state->mode == RENDER && argc != 6)
+    }
+
+    if ((value = GetOption(argc, argv, "codec", "PFS_CODEC")) != NULL)
+        settings->codec = value;
+    if ((value = GetOption(argc, argv, "preset", "PFS_PRESET")) != NULL)
+        settings->preset = value;
+    settings->crf               = GetOptionInt(argc, argv, "crf", "PFS_CRF", settings->crf);
+    settings->threads           = GetOptionInt(argc, argv, "encoder-threads", "PFS_ENCODER_THREADS", settings->threads);
+    settings->convert_threads   = GetOptionInt(argc, argv, "convert-threads", "PFS_CONVERT_THREADS", settings->convert_threads);
+    settings->chunk_frames      = GetOptionInt(argc, argv, "chunk-frames", "PFS_CHUNK_FRAMES", settings->chunk_frames);
+    settings->compression_level = GetOptionInt(argc, argv, "compression-level", "PFS_COMPRESSION_LEVEL", settings->compression_level);
+    settings->archive_memory    = GetOptionInt(argc, argv, "archive-memory", "PFS_ARCHIVE_MEMORY", settings->archive_memory);
+    if (settings->threads < 0 || settings->convert_threads < 1 || settings->chunk_frames < 1 || settings->archive_memory < 1)
     {
-        fprintf(stderr, "ERROR: Please provide simulation duration.\n");
+        fprintf(stderr, "ERROR: Encoder thread, chunk counts and archive memory must be positive.\n");
         exit(EXIT_FAILURE);
     }
-    
-    sim_state->counter = 0.0f;  
-    sim_state->dt = 1.0f / (float)sim_state->fps;
-    sim_state->loading_bar_size = (Vector2){ 300.0f, 50.0f };
-    sim_state->loading_bar_offset = 10.0f;
-    sim_state->percentage_font_size = 50.0f;
 }
 
 void InitSimulation(SimulationState *sim_state, Vector2 start_view, const char *title)
 {
+    EncoderSettings encoder_settings = sim_state->encoder_settings;
+    RenderOutputConfig *config;
+    long cores;
+
+    if (sim_state->hidden)
+        SetConfigFlags(FLAG_WINDOW_HIDDEN);
     InitWindow(0, 0, title);
     sim_state->monitor_width  = GetScreenWidth();
     sim_state->monitor_height = GetScreenHeight();
@@ -171,49 +1472,115 @@ void InitSimulation(SimulationState *sim_state, Vector2 start_view, const char *
     if (sim_state->mode != RENDER)
         SetTargetFPS(sim_state->fps);
     
-    ToggleFullscreen();
+    if (!sim_state->hidden)
+        ToggleFullscreen();
     
-    sim_state->target      = LoadRenderTexture(sim_state->target_resolution_width, sim_state->target_resolution_height);
     sim_state->origin      = (Vector2){ 0.0f, 0.0f };
-    sim_state->source      = (Rectangle){ 0.0f, 0.0f, sim_state->target_resolution_width, -sim_state->target_resolution_height };
     sim_state->destination = (Rectangle){ 0.0f, 0.0f, sim_state->monitor_width, sim_state->monitor_height }; 
-        
-    sim_state->ffmpeg = NULL;
-    if (sim_state->mode != RUN)
+    sim_state->outputs_size  = 0;
+    sim_state->active_output = -1;
+    FormatTimestamp(sim_state->timestamp, NULL);
+
+    // Left at 0 every encoder would size its pool to all cores, so split them
+    // between the outputs instead.
+    if (encoder_settings.threads == 0)
+    {
+        cores = sysconf(_SC_NPROCESSORS_ONLN) / (long)(1 + sim_state->output_configs_size);
+        encoder_settings.threads = (cores > 1) ? cores : 1;
+    }
+
+    AddRenderOutput(sim_state, "", sim_state->target_resolution_width, sim_state->target_resolution_height, start_view,
+            sim_state->overlays, encoder_settings);
+    for (size_t i=0; i < sim_state->output_configs_size; i++)
     {
-        sim_state->ffmpeg = StartFFMPEGProcess(sim_state->target_resolution_width, sim_state->target_resolution_height, sim_state->fps, "videos", "quiet");
+        config = &sim_state->output_configs[i];
+        AddRenderOutput(sim_state, config->name, config->width, config->height, start_view,
+                config->overlays, encoder_settings);
+    }
+
+    if (sim_state->mode != RUN)
         SetTraceLogLevel(LOG_NONE);
-    } 
     
     sim_state->gui_camera.offset   = (Vector2){ sim_state->monitor_width / 2.0f, sim_state->monitor_height / 2.0f };  
     sim_state->gui_camera.target   = (Vector2){ 0.0f, 0.0f };
     sim_state->gui_camera.rotation = 0.0f;
     sim_state->gui_camera.zoom     = 1.0f;
+}
+
+size_t AddRenderOutput(SimulationState *sim_state, const char *name, int width, int height, Vector2 view, unsigned int overlays, EncoderSettings encoder_settings)
+{
+    if (sim_state->outputs_size == OUTPUTS_CAP)
+    {
+        fprintf(stderr, "ERROR: Can not add more than %d render outputs.\n", OUTPUTS_CAP);
+        exit(EXIT_FAILURE);
+    }
 
-    sim_state->camera.offset   = (Vector2){ sim_state->target_resolution_width / 2.0f, sim_state->target_resolution_height / 2.0f };
-    sim_state->camera.target   = (Vector2){ 0.0f, 0.0f };
-    sim_state->camera.rotation = 0.0f;
-    if (start_view.x > start_view.y)
-        sim_state->camera.zoom = (float)sim_state->target_resolution_width / start_view.x;
+    // Outputs share the timestamp, so equal names would write the same file.
+    for (size_t i=0; i < sim_state->outputs_size; i++)
+        if (strcmp(sim_state->outputs[i].name, name) == 0)
+        {
+            fprintf(stderr, "ERROR: There already is an output named '%s'.\n", name);
+            exit(EXIT_FAILURE);
+        }
+
+    RenderOutput *output = &sim_state->outputs[sim_state->outputs_size];
+    snprintf(output->name, TITLE_CAP, "%s", name);
+    output->width            = width;
+    output->height           = height;
+    output->overlays         = overlays;
+    output->encoder_settings = encoder_settings;
+    output->target           = LoadRenderTexture(width, height);
+    output->source           = (Rectangle){ 0.0f, 0.0f, width, -height };
+
+    output->camera.offset   = (Vector2){ width / 2.0f, height / 2.0f };
+    output->camera.target   = (Vector2){ 0.0f, 0.0f };
+    output->camera.rotation = 0.0f;
+    if (view.x > view.y)
+        output->camera.zoom = (float)width / view.x;
     else
-        sim_state->camera.zoom = (float)sim_state->target_resolution_height / start_view.y;
+        output->camera.zoom = (float)height / view.y;
+
+    output->encoder = NULL;
+    if (sim_state->mode != RUN)
+        output->encoder = StartEncoder(encoder_settings, width, height, sim_state->fps, sim_state->output_dir, name, sim_state->timestamp);
+
+    return sim_state->outputs_size++;
+}
+
+void BeginRenderOutput(SimulationState *sim_state, size_t index, Color clear_color)
+{
+    if (sim_state->active_output >= 0)
+    {
+        EndMode2D();
+        EndTextureMode();
+    }
+
+    sim_state->active_output = index;
+    BeginTextureMode(sim_state->outputs[index].target);
+    ClearBackground(clear_color);
+    BeginMode2D(sim_state->outputs[index].camera);
 }
 
 void BeginSimulationMode(SimulationState *sim_state, Color clear_color)
 {
     BeginDrawing();
-    BeginTextureMode(sim_state->target);
-    ClearBackground(clear_color);
-    BeginMode2D(sim_state->camera);
+    BeginRenderOutput(sim_state, 0, clear_color);
 }
 
 int EndSimulationMode(SimulationState *sim_state)
 {
-    EndMode2D();
-    EndTextureMode();
+    RenderOutput *screen = &sim_state->outputs[0];
+    Image image;
+
+    if (sim_state->active_output >= 0)
+    {
+        EndMode2D();
+        EndTextureMode();
+        sim_state->active_output = -1;
+    }
     
     if (sim_state->mode != RENDER)
-        DrawTexturePro(sim_state->target.texture, sim_state->source, sim_state->destination, sim_state->origin, 0.0f, WHITE);
+        DrawTexturePro(screen->target.texture, screen->source, sim_state->destination, sim_state->origin, 0.0f, WHITE);
     else 
     {
         char percentage[6];
@@ -241,9 +1608,12 @@ int EndSimulationMode(SimulationState *sim_state)
 
     if (sim_state->mode != RUN)
     {
-        sim_state->image = LoadImageFromTexture(sim_state->target.texture);
-        FeedFFMPEGInverted(sim_state->ffmpeg, sim_state->image.data);
-        UnloadImage(sim_state->image);        
+        for (size_t i=0; i < sim_state->outputs_size; i++)
+        {
+            image = LoadImageFromTexture(sim_state->outputs[i].target.texture);
+            FeedEncoderInverted(sim_state->outputs[i].encoder, image.data);
+            UnloadImage(image);        
+        }
     }
     
     EndDrawing();
@@ -257,9 +1627,12 @@ int EndSimulationMode(SimulationState *sim_state)
 
 void CloseSimulation(SimulationState *sim_state)
 {
-    UnloadRenderTexture(sim_state->target);
+    for (size_t i=0; i < sim_state->outputs_size; i++)
+    {
+        UnloadRenderTexture(sim_state->outputs[i].target);
+        if (sim_state->outputs[i].encoder != NULL)
+            CloseEncoder(sim_state->outputs[i].encoder);
+    }
     CloseWindow();
-    if (sim_state->mode == RENDER || sim_state->mode == BOTH)
-        CloseFFMPEG(sim_state->ffmpeg);
 }
 
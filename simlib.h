@@ -3,30 +3,95 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <stdint.h>
-#include <string.h>
-#include <time.h>
-#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <raylib.h>
-#include <unistd.h>
-#include <sys/types.h>
-#include <sys/wait.h>
-#include <sys/stat.h>
 
-#define READ_END         0
-#define WRITE_END        1
+// The encoder backends and the frame pipeline are opaque, so their layout and
+// the optional zstd and libav headers stay inside simlib.c.
+
 #define RESOLUTION_CAP  32
 #define FPS_CAP         16
 #define OUTPUT_NAME_CAP 514
 #define TITLE_CAP       64
+#define OUTPUTS_CAP      8
+#define TIMESTAMP_CAP   32
+#define OPTIONS_CAP     64
+
+enum EncoderBackend
+{
+    ENCODER_FFMPEG_PIPE,
+    ENCODER_LIBAV,
+    ENCODER_PNG_SEQUENCE,
+    ENCODER_RAW_CHUNKS
+};
+
+typedef struct
+{
+    enum EncoderBackend backend;
+    const char *codec;
+    const char *preset;
+    int crf;
+    int threads;
+    int convert_threads;
+    int chunk_frames;
+    int compression_level;
+    int archive_memory;
+} EncoderSettings;
+
+typedef struct FFMPEG FFMPEG;
+typedef struct FrameArchive FrameArchive;
+typedef struct LibavEncoder LibavEncoder;
+typedef struct Encoder Encoder;
+typedef struct FramePipeline FramePipeline;
 
+// Particles are uploaded as four floats each: x, y, vel_x, vel_y.
 typedef struct
 {
-    size_t width;
-    size_t height;
-    int pipe;
-    pid_t pid;
-} FFMPEG;
+    size_t capacity;
+    unsigned int vao;
+    unsigned int quad_vbo;
+    unsigned int instance_vbo;
+    int corner_location;
+    int particle_location;
+    int mvp_location;
+    int scale_location;
+    int radius_location;
+    int speed_range_location;
+    Shader shader;
+} ParticleRenderer;
+
+enum Overlay
+{
+    OVERLAY_PARTICLES = 1 << 0,
+    OVERLAY_WALLS     = 1 << 1,
+    OVERLAY_PRESSURE  = 1 << 2
+};
+
+// One rendered view of the simulated frame with its own camera, resolution
+// and encoder. Output 0 is the one shown on screen.
+typedef struct
+{
+    char name[TITLE_CAP];
+    int width;
+    int height;
+    unsigned int overlays;
+    Camera2D camera;
+    RenderTexture2D target;
+    Rectangle source;
+    EncoderSettings encoder_settings;
+    Encoder *encoder;
+} RenderOutput;
+
+// A render output requested on the command line, created by InitSimulation
+// once the window and GL context exist.
+typedef struct
+{
+    char name[TITLE_CAP];
+    int width;
+    int height;
+    unsigned int overlays;
+} RenderOutputConfig;
 
 enum Mode
 {
@@ -46,28 +111,70 @@ typedef struct
     float duration;
     float counter;
     float dt;
+    bool hidden;
+    unsigned int overlays;
+    char output_dir[OUTPUT_NAME_CAP];
+    RenderOutputConfig output_configs[OUTPUTS_CAP];
+    size_t output_configs_size;
     Camera2D gui_camera;
-    Camera2D camera;
-    RenderTexture2D target;
-    Image image;
     Vector2 origin;
-    Rectangle source;
     Rectangle destination;
-    FFMPEG *ffmpeg;
+    EncoderSettings encoder_settings;
+    char timestamp[TIMESTAMP_CAP];
+    RenderOutput outputs[OUTPUTS_CAP];
+    size_t outputs_size;
+    int active_output;
     Vector2 loading_bar_size;
     float loading_bar_offset;
     float percentage_font_size;
 } SimulationState;
 
 
-FFMPEG *StartFFMPEGProcess(const size_t width, const size_t height, const size_t FPS, const char *output, const char *log_level);
+EncoderSettings DefaultEncoderSettings(void);
+
+FFMPEG *StartFFMPEGProcess(const size_t width, const size_t height, const size_t FPS, const char *output, const char *name, const char *timestamp, const char *log_level, EncoderSettings settings);
 void    FeedFFMPEG(FFMPEG *ffmpeg, void *data);
 void    FeedFFMPEGInverted(FFMPEG *ffmpeg, void *data);
 void    CloseFFMPEG(FFMPEG *ffmpeg);
 
+#ifdef SIMLIB_LIBAV
+LibavEncoder *StartLibavEncoder(const size_t width, const size_t height, const size_t FPS, const char *output_dir, const char *name, const char *timestamp, EncoderSettings settings);
+void    FeedLibavEncoderInverted(LibavEncoder *encoder, void *data);
+void    CloseLibavEncoder(LibavEncoder *encoder);
+#endif
+
+FrameArchive *StartFrameArchive(EncoderSettings settings, const size_t width, const size_t height, const char *output_dir, const char *name, const char *timestamp);
+void    FeedFrameArchiveInverted(FrameArchive *archive, void *data);
+void    CloseFrameArchive(FrameArchive *archive);
+
+Encoder *StartEncoder(EncoderSettings settings, const size_t width, const size_t height, const size_t FPS, const char *output_dir, const char *name, const char *timestamp);
+void    FeedEncoderInverted(Encoder *encoder, void *data);
+void    CloseEncoder(Encoder *encoder);
+
+ParticleRenderer *LoadParticleRenderer(size_t capacity);
+void    DrawParticlesInstanced(ParticleRenderer *renderer, const void *particles, size_t count, float scale, float radius, float min_speed, float max_speed);
+void    UnloadParticleRenderer(ParticleRenderer *renderer);
+
+FramePipeline *CreateFramePipeline(void *front, void *back);
+void   *AcquireWriteFrame(FramePipeline *pipeline);
+void    PublishWriteFrame(FramePipeline *pipeline);
+void   *AcquireReadFrame(FramePipeline *pipeline);
+void    ReleaseReadFrame(FramePipeline *pipeline);
+void    StopFramePipeline(FramePipeline *pipeline);
+void    CloseFramePipeline(FramePipeline *pipeline);
+
+const char *GetOption(int argc, char **argv, const char *name, const char *env);
+int     GetOptionInt(int argc, char **argv, const char *name, const char *env, int fallback);
+float   GetOptionFloat(int argc, char **argv, const char *name, const char *env, float fallback);
+bool    GetOptionBool(int argc, char **argv, const char *name, const char *env, bool fallback);
+void    CheckOptions(int argc, char **argv);
+void    PrintSimulationUsage(FILE *stream);
+
 void    CreateSimulationState(SimulationState *sim_state, enum Mode mode, int target_resolution_width, int target_resolution_height, int fps, int duration);
 void    ParseSimulationState(SimulationState *sim_state, int argc, char **argv);
 void    InitSimulation(SimulationState *sim_state, Vector2 start_view, const char *title);
+size_t  AddRenderOutput(SimulationState *sim_state, const char *name, int width, int height, Vector2 view, unsigned int overlays, EncoderSettings encoder_settings);
+void    BeginRenderOutput(SimulationState *sim_state, size_t index, Color clear_color);
 void    BeginSimulationMode(SimulationState *sim_state, Color clear_color);
 int     EndSimulationMode(SimulationState *sim_state);
 void    CloseSimulation(SimulationState *sim_state);
@@ -0,0 +1,535 @@
+#include <float.h>
+#include <stdio.h>
+#include <string.h>
+#include "pfs_internal.h"
+
+// Headless checks of the solver invariants, no raylib needed.
+// Usage: tests, exits with a failure status if any check fails.
+
+#define TESTS_LATTICE 16
+#define TESTS_STEPS 200
+
+static int failures = 0;
+
+static void check(bool passed, const char *name, double value, double limit)
+{
+    printf("%-48s %12.3e %12.3e  %s\n", name, value, limit, passed ? "ok" : "FAILED");
+    if (!passed)
+        failures++;
+}
+
+// Elastic particles on a lattice in the middle of a large closed box, so
+// nothing reaches the borders (which respawn) within the test.
+static void tests_state(PFS_state_t *state, PFS_solver_t solver, PFS_broadphase_t broadphase)
+{
+    *state = pfs_state_default();
+    state->pixel_to_meter = 0.001f;
+    state->space_width = 1.0f;
+    state->space_height = 1.0f;
+    state->particle_radius = 0.01f;
+    state->time_speed = 1.0f;
+    state->start_velocity_magnitude = 0.1f;
+    state->g = 0.0f;
+    state->solver = solver;
+    state->broadphase = broadphase;
+    state->contact_warm_start = 0.0f;
+    state->contact_bounce_threshold = 0.001f;
+}
+
+static void tests_lattice(PFS_t *pfs, float spacing)
+{
+    PFS_particle_t *particle;
+    float random_angle;
+    float origin = (pfs->state->space_width - spacing * (TESTS_LATTICE - 1)) / 2.0f;
+
+    srand(1);
+    for (size_t i=0; i < pfs->particles_size; i++)
+    {
+        particle = &pfs->particles_array[i];
+        random_angle = ((float)rand() / RAND_MAX) * 2.0f * M_PI;
+        particle->x = origin + spacing * (i % TESTS_LATTICE);
+        particle->y = origin + spacing * (i / TESTS_LATTICE);
+        particle->vel_x = cos(random_angle) * pfs->state->start_velocity_magnitude;
+        particle->vel_y = -sin(random_angle) * pfs->state->start_velocity_magnitude;
+    }
+}
+
+static double kinetic_energy(PFS_t *pfs)
+{
+    double energy = 0.0;
+
+    for (size_t i=0; i < pfs->particles_size; i++)
+        energy += 0.5 * ((double)pfs->particles_array[i].vel_x * pfs->particles_array[i].vel_x +
+                         (double)pfs->particles_array[i].vel_y * pfs->particles_array[i].vel_y);
+
+    return energy;
+}
+
+typedef struct
+{
+    const char *name;
+    PFS_solver_t solver;
+    PFS_contact_solver_type_t contact_solver;
+    int contact_iterations;
+    float contact_warm_start;
+    float spacing;
+    bool swept;
+    bool walls;
+    double max_loss;
+    double max_gain;
+} energy_case_t;
+
+// Relative change of the kinetic energy with e = 1. Lattices wider than the
+// contact distance only see binary impacts and must keep their energy, denser
+// ones start out jammed and may lose energy on persisting contacts, but no
+// iteration count or solver may ever add any.
+static void test_energy(energy_case_t *test)
+{
+    PFS_state_t state;
+    PFS_t pfs;
+    PFS_compact_t compact;
+    const float dt = 1.0f / 240.0f;
+    const float thickness = 0.05f;
+    float inner;
+    double start;
+    double drift;
+
+    tests_state(&state, test->solver, PFS_BROADPHASE_GRID);
+    state.contact_solver = test->contact_solver;
+    state.contact_iterations = test->contact_iterations;
+    state.contact_warm_start = test->contact_warm_start;
+    pfs_create(&pfs, &state, TESTS_LATTICE * TESTS_LATTICE);
+    tests_lattice(&pfs, test->spacing * state.particle_radius);
+
+    // A box just around the lattice, so most particles hit a wall.
+    if (test->walls)
+    {
+        inner = test->spacing * state.particle_radius * TESTS_LATTICE / 2.0f + state.particle_radius;
+        pfs_add_wall(&pfs, 0.5f - inner - thickness, 0.5f - inner - thickness, 2.0f * (inner + thickness), thickness);
+        pfs_add_wall(&pfs, 0.5f - inner - thickness, 0.5f + inner, 2.0f * (inner + thickness), thickness);
+        pfs_add_wall(&pfs, 0.5f - inner - thickness, 0.5f - inner, thickness, 2.0f * inner);
+        pfs_add_wall(&pfs, 0.5f + inner, 0.5f - inner, thickness, 2.0f * inner);
+    }
+    start = kinetic_energy(&pfs);
+
+    if (test->solver == PFS_SOLVER_COMPACT)
+    {
+        pfs_compact_create(&compact, pfs.particles_size);
+        pfs_compact_pack(&pfs, &compact);
+    }
+
+    for (int n=0; n < TESTS_STEPS; n++)
+    {
+        if (test->solver == PFS_SOLVER_EVENT_DRIVEN)
+        {
+            pfs_advance_events(&pfs, dt);
+            continue;
+        }
+        if (test->solver == PFS_SOLVER_COMPACT)
+        {
+            pfs_compact_update(&pfs, &compact, dt);
+            continue;
+        }
+
+        if (test->swept)
+            pfs_handle_collisions_swept(&pfs, dt);
+        for (size_t i=0; i < pfs.particles_size; i++)
+            pfs_update_particle(&pfs, &pfs.particles_array[i], dt);
+        pfs_handle_collisions(&pfs);
+    }
+
+    if (test->solver == PFS_SOLVER_COMPACT)
+    {
+        pfs_compact_unpack(&pfs, &compact);
+        pfs_compact_close(&compact);
+    }
+
+    drift = (kinetic_energy(&pfs) - start) / start;
+    check(-test->max_loss <= drift && drift <= test->max_gain, test->name, drift, (drift < 0.0) ? -test->max_loss : test->max_gain);
+    pfs_close(&pfs);
+}
+
+// Both broadphases must find exactly the same contacts from the same state.
+static void test_broadphase(void)
+{
+    PFS_state_t state;
+    PFS_t brute;
+    PFS_t grid;
+    size_t mismatches = 0;
+    PFS_contact_solver_t *s0;
+    PFS_contact_solver_t *s1;
+
+    tests_state(&state, PFS_SOLVER_TIME_STEPPED, PFS_BROADPHASE_BRUTE_FORCE);
+    pfs_create(&brute, &state, TESTS_LATTICE * TESTS_LATTICE);
+    pfs_create(&grid, &state, TESTS_LATTICE * TESTS_LATTICE);
+
+    // Dense enough that most particles overlap several neighbours.
+    tests_lattice(&brute, 0.6f * state.particle_radius);
+    memcpy(grid.particles_array, brute.particles_array, sizeof(PFS_particle_t) * brute.particles_size);
+
+    state.broadphase = PFS_BROADPHASE_BRUTE_FORCE;
+    pfs_handle_collisions(&brute);
+    state.broadphase = PFS_BROADPHASE_GRID;
+    pfs_handle_collisions(&grid);
+
+    s0 = &brute.internal->contact_solver;
+    s1 = &grid.internal->contact_solver;
+    if (s0->previous_size != s1->previous_size)
+        mismatches = s0->previous_size + s1->previous_size;
+    else
+        for (size_t c=0; c < s0->previous_size; c++)
+            if (s0->previous[c].a != s1->previous[c].a || s0->previous[c].wall != s1->previous[c].wall || s0->previous[c].b != s1->previous[c].b)
+                mismatches++;
+
+    check(s0->previous_size > 0, "broadphase contacts found", s0->previous_size, 1);
+    check(mismatches == 0, "broadphase grid vs brute force mismatches", mismatches, 0);
+
+    pfs_close(&grid);
+    pfs_close(&brute);
+}
+
+static void test_compact_round_trip(void)
+{
+    PFS_state_t state;
+    PFS_t pfs;
+    PFS_compact_t compact;
+    PFS_particle_t *start;
+    double position_error = 0.0;
+    double velocity_error = 0.0;
+    double position_step;
+    double velocity_step;
+    size_t particles = TESTS_LATTICE * TESTS_LATTICE;
+
+    tests_state(&state, PFS_SOLVER_TIME_STEPPED, PFS_BROADPHASE_GRID);
+    pfs_create(&pfs, &state, particles);
+    srand(2);
+    pfs_start_random(&pfs);
+    start = (PFS_particle_t *)malloc(sizeof(PFS_particle_t) * particles);
+    memcpy(start, pfs.particles_array, sizeof(PFS_particle_t) * particles);
+
+    pfs_compact_create(&compact, particles);
+    pfs_compact_pack(&pfs, &compact);
+    pfs_compact_unpack(&pfs, &compact);
+
+    for (size_t i=0; i < particles; i++)
+    {
+        position_error = fmax(position_error, fabs(pfs.particles_array[i].x - start[i].x));
+        position_error = fmax(position_error, fabs(pfs.particles_array[i].y - start[i].y));
+        velocity_error = fmax(velocity_error, fabs(pfs.particles_array[i].vel_x - start[i].vel_x));
+        velocity_error = fmax(velocity_error, fabs(pfs.particles_array[i].vel_y - start[i].vel_y));
+    }
+
+    // Stochastic rounding is off by at most one step, and 32-bit positions
+    // are finer than the float they unpack to.
+    position_step = 1.01 * fmax(state.space_width / PFS_FIXED_MAX, state.space_width * FLT_EPSILON);
+    velocity_step = 1.01 * compact.max_speed / PFS_VELOCITY_MAX;
+    check(pfs.particles_size == particles, "compact round trip particle count", pfs.particles_size, particles);
+    check(position_error <= position_step, "compact round trip position error", position_error, position_step);
+    check(velocity_error <= velocity_step, "compact round trip velocity error", velocity_error, velocity_step);
+
+    pfs_compact_close(&compact);
+    free(start);
+    pfs_close(&pfs);
+}
+
+// Gravity over a substep is far below one velocity step, only the stochastic
+// rounding lets it accumulate.
+static void test_compact_gravity(void)
+{
+    PFS_state_t state;
+    PFS_t pfs;
+    PFS_compact_t compact;
+    const float dt = 1.0f / 240.0f;
+    const int steps = 60;
+    double start = 0.0;
+    double end = 0.0;
+    double expected;
+    double error;
+    size_t particles = TESTS_LATTICE * TESTS_LATTICE;
+
+    tests_state(&state, PFS_SOLVER_TIME_STEPPED, PFS_BROADPHASE_GRID);
+    state.time_speed = 0.01f;
+    state.g = 9.8066f;
+    pfs_create(&pfs, &state, particles);
+    tests_lattice(&pfs, 1.5f * state.particle_radius);
+    for (size_t i=0; i < particles; i++)
+        start += pfs.particles_array[i].vel_y / particles;
+
+    pfs_compact_create(&compact, particles);
+    pfs_compact_pack(&pfs, &compact);
+    for (int n=0; n < steps; n++)
+        pfs_compact_update(&pfs, &compact, dt);
+    pfs_compact_unpack(&pfs, &compact);
+
+    for (size_t i=0; i < particles; i++)
+        end += pfs.particles_array[i].vel_y / particles;
+
+    expected = state.g * dt * state.time_speed * steps;
+    error = fabs((end - start) - expected) / expected;
+    check(error <= 0.05, "compact gravity mean velocity error", error, 0.05);
+
+    pfs_compact_close(&compact);
+    pfs_close(&pfs);
+}
+
+// A long fall in a tall domain takes the velocities far past the scale set
+// by the pack, which has to grow with them instead of clamping.
+static void test_compact_rescale(void)
+{
+    PFS_state_t state;
+    PFS_t pfs;
+    PFS_compact_t compact;
+    const float dt = 1.0f / 240.0f;
+    double start = 0.0;
+    double end = 0.0;
+    double expected;
+    double error;
+    float max_speed;
+    size_t particles = TESTS_LATTICE * TESTS_LATTICE;
+
+    tests_state(&state, PFS_SOLVER_COMPACT, PFS_BROADPHASE_GRID);
+    state.space_height = 10.0f;
+    state.g = 9.8066f;
+    pfs_create(&pfs, &state, particles);
+    tests_lattice(&pfs, 1.5f * state.particle_radius);
+    for (size_t i=0; i < particles; i++)
+        start += pfs.particles_array[i].vel_y / particles;
+
+    pfs_compact_create(&compact, particles);
+    pfs_compact_pack(&pfs, &compact);
+    max_speed = compact.max_speed;
+    for (int n=0; n < TESTS_STEPS; n++)
+        pfs_compact_update(&pfs, &compact, dt);
+    pfs_compact_unpack(&pfs, &compact);
+
+    for (size_t i=0; i < particles; i++)
+        end += pfs.particles_array[i].vel_y / particles;
+
+    expected = state.g * dt * state.time_speed * TESTS_STEPS;
+    error = fabs((end - start) - expected) / expected;
+    check(compact.max_speed > 16.0f * max_speed, "compact rescale growth", compact.max_speed / max_speed, 16.0);
+    check(compact.clamped == 0, "compact rescale clamped velocities", compact.clamped, 0);
+    check(error <= 1e-3, "compact rescale mean velocity error", error, 1e-3);
+
+    pfs_compact_close(&compact);
+    pfs_close(&pfs);
+}
+
+// Between events particles follow exact parabolas, so with e = 1 the sum of
+// kinetic and potential energy stays put while they bounce around a box.
+static void test_events_gravity(void)
+{
+    PFS_state_t state;
+    PFS_t pfs;
+    const float dt = 1.0f / 240.0f;
+    const float thickness = 0.05f;
+    float inner;
+    double start = 0.0;
+    double energy = 0.0;
+    double scale;
+    double drift;
+
+    tests_state(&state, PFS_SOLVER_EVENT_DRIVEN, PFS_BROADPHASE_GRID);
+    state.g = 9.8066f;
+    pfs_create(&pfs, &state, TESTS_LATTICE * TESTS_LATTICE);
+    tests_lattice(&pfs, 1.5f * state.particle_radius);
+
+    inner = 1.5f * state.particle_radius * TESTS_LATTICE / 2.0f + state.particle_radius;
+    pfs_add_wall(&pfs, 0.5f - inner - thickness, 0.5f - inner - thickness, 2.0f * (inner + thickness), thickness);
+    pfs_add_wall(&pfs, 0.5f - inner - thickness, 0.5f + inner, 2.0f * (inner + thickness), thickness);
+    pfs_add_wall(&pfs, 0.5f - inner - thickness, 0.5f - inner, thickness, 2.0f * inner);
+    pfs_add_wall(&pfs, 0.5f + inner, 0.5f - inner, thickness, 2.0f * inner);
+
+    // Positive g pulls towards larger y.
+    for (size_t i=0; i < pfs.particles_size; i++)
+        start -= state.g * pfs.particles_array[i].y;
+    start += kinetic_energy(&pfs);
+
+    for (int n=0; n < TESTS_STEPS; n++)
+        pfs_advance_events(&pfs, dt);
+
+    for (size_t i=0; i < pfs.particles_size; i++)
+        energy -= state.g * pfs.particles_array[i].y;
+    energy += kinetic_energy(&pfs);
+
+    // Relative to the most energy a particle can gain falling across the box.
+    scale = pfs.particles_size * state.g * 2.0 * inner;
+    drift = (energy - start) / scale;
+    check(fabs(drift) <= 1e-3, "energy, event driven, gravity", drift, 1e-3);
+    pfs_close(&pfs);
+}
+
+// A single fast particle is swept on its own instead of growing the grid
+// cells, it must still hit the lattice and agree with brute force.
+static void test_long_sweep(void)
+{
+    PFS_state_t state;
+    PFS_t pfs[2];
+    PFS_particle_t *fast;
+    const float dt = 1.0f / 240.0f;
+    const float speed = 30.0f;
+    float origin;
+
+    tests_state(&state, PFS_SOLVER_TIME_STEPPED, PFS_BROADPHASE_GRID);
+    for (int b=0; b < 2; b++)
+    {
+        pfs_create(&pfs[b], &state, TESTS_LATTICE * TESTS_LATTICE + 1);
+        pfs[b].particles_size--;
+        tests_lattice(&pfs[b], 1.5f * state.particle_radius);
+        pfs[b].particles_size++;
+
+        // Head on into the middle of the left column, 8 radii out.
+        origin = (state.space_width - 1.5f * state.particle_radius * (TESTS_LATTICE - 1)) / 2.0f;
+        fast = &pfs[b].particles_array[TESTS_LATTICE * TESTS_LATTICE];
+        *fast = pfs[b].particles_array[TESTS_LATTICE * (TESTS_LATTICE / 2)];
+        fast->x = origin - 8.0f * state.particle_radius;
+        fast->vel_x = speed;
+        fast->vel_y = 0.0f;
+    }
+
+    state.broadphase = PFS_BROADPHASE_GRID;
+    pfs_handle_collisions_swept(&pfs[0], dt);
+    state.broadphase = PFS_BROADPHASE_BRUTE_FORCE;
+    pfs_handle_collisions_swept(&pfs[1], dt);
+
+    check(pfs[0].internal->grid.long_sweeps_size == 1, "long sweep, fast particles", pfs[0].internal->grid.long_sweeps_size, 1);
+    fast = &pfs[0].particles_array[TESTS_LATTICE * TESTS_LATTICE];
+    check(fast->vel_x < 0.5f * speed, "long sweep, hit", fast->vel_x, 0.5f * speed);
+    check(fast->vel_x == pfs[1].particles_array[TESTS_LATTICE * TESTS_LATTICE].vel_x, "long sweep, grid vs brute force",
+            fast->vel_x, pfs[1].particles_array[TESTS_LATTICE * TESTS_LATTICE].vel_x);
+
+    pfs_close(&pfs[0]);
+    pfs_close(&pfs[1]);
+}
+
+// Impacts far faster than the radius per step must not pass through a thin
+// wall or through each other with the swept pass.
+static void test_tunnelling(void)
+{
+    PFS_state_t state;
+    PFS_t pfs;
+    PFS_particle_t *a;
+    PFS_particle_t *b;
+    const float dt = 1.0f / 240.0f;
+    const float speed = 30.0f;
+
+    tests_state(&state, PFS_SOLVER_TIME_STEPPED, PFS_BROADPHASE_GRID);
+    pfs_create(&pfs, &state, 2);
+    a = &pfs.particles_array[0];
+    b = &pfs.particles_array[1];
+
+    // Half a radius thick, the particle moves 12.5 radii per step.
+    *a = (PFS_particle_t){ .x = 0.3f, .y = 0.5f, .vel_x = speed, .vel_y = 0.0f };
+    *b = (PFS_particle_t){ .x = 0.3f, .y = 0.1f, .vel_x = 0.0f, .vel_y = 0.0f };
+    pfs_add_wall(&pfs, 0.5f, 0.4f, 0.5f * state.particle_radius, 0.2f);
+    for (int n=0; n < 3; n++)
+    {
+        pfs_handle_collisions_swept(&pfs, dt);
+        for (size_t i=0; i < pfs.particles_size; i++)
+            pfs_update_particle(&pfs, &pfs.particles_array[i], dt);
+        pfs_handle_collisions(&pfs);
+    }
+    check(a->x < 0.5f - state.particle_radius, "tunnelling, thin wall position", a->x, 0.5f - state.particle_radius);
+    check(fabs(a->vel_x + speed) <= 1e-3 * speed, "tunnelling, thin wall velocity", a->vel_x, -speed);
+
+    // Head on, they close 25 radii per step.
+    pfs.walls_size = 0;
+    *a = (PFS_particle_t){ .x = 0.3f, .y = 0.5f, .vel_x = speed, .vel_y = 0.0f };
+    *b = (PFS_particle_t){ .x = 0.7f, .y = 0.5f, .vel_x = -speed, .vel_y = 0.0f };
+    for (int n=0; n < 3; n++)
+    {
+        pfs_handle_collisions_swept(&pfs, dt);
+        for (size_t i=0; i < pfs.particles_size; i++)
+            pfs_update_particle(&pfs, &pfs.particles_array[i], dt);
+        pfs_handle_collisions(&pfs);
+    }
+    check(a->x < b->x, "tunnelling, head-on order", b->x - a->x, 0.0);
+    check(fabs(a->vel_x + speed) <= 1e-3 * speed && fabs(b->vel_x - speed) <= 1e-3 * speed,
+            "tunnelling, head-on velocity", a->vel_x, -speed);
+
+    pfs_close(&pfs);
+}
+
+static void test_sources(void)
+{
+    PFS_state_t state;
+    PFS_t pfs;
+    const float dt = 1.0f / 240.0f;
+    size_t particles = TESTS_LATTICE;
+    size_t capacity = 4 * TESTS_LATTICE;
+    bool sunk = true;
+
+    tests_state(&state, PFS_SOLVER_TIME_STEPPED, PFS_BROADPHASE_GRID);
+    pfs_create(&pfs, &state, particles);
+    tests_lattice(&pfs, 1.5f * state.particle_radius);
+    pfs_reserve(&pfs, capacity);
+    pfs_add_emitter(&pfs, 0.0f, 0.0f, 0.1f, 0.1f, 240.0f, 0.0f, 0.0f);
+
+    // One particle per substep until the reserved pool is full.
+    for (int n=0; n < 10; n++)
+        pfs_update_sources(&pfs, dt);
+    check(pfs.particles_size == particles + 10, "emitter particles added", pfs.particles_size, particles + 10);
+    for (int n=0; n < 100; n++)
+        pfs_update_sources(&pfs, dt);
+    check(pfs.particles_size == capacity, "emitter stops at capacity", pfs.particles_size, capacity);
+
+    pfs.emitters_size = 0;
+    pfs_add_sink(&pfs, 0.0f, 0.0f, 0.1f, 0.1f);
+    pfs_update_sources(&pfs, dt);
+    for (size_t i=0; i < pfs.particles_size; i++)
+        sunk = sunk && !(pfs.particles_array[i].x <= 0.1f && pfs.particles_array[i].y <= 0.1f);
+    check(sunk && pfs.particles_size == particles, "sink removes emitted particles", pfs.particles_size, particles);
+
+    pfs_close(&pfs);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1)
+    {
+        fprintf(stderr, "ERROR: Usage: %s\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("pfs %d.%d.%d\n", PFS_VERSION_MAJOR, PFS_VERSION_MINOR, PFS_VERSION_PATCH);
+    printf("%-48s %12s %12s\n", "check", "value", "limit");
+
+    // Without the swept pass every impact goes through the contact solver.
+    energy_case_t energy_cases[] = {
+        { "energy, event driven",                   PFS_SOLVER_EVENT_DRIVEN, PFS_CONTACT_GAUSS_SEIDEL,  4, 0.0f, 1.5f, false, false, 1e-4, 1e-4 },
+        { "energy, event driven, walls",            PFS_SOLVER_EVENT_DRIVEN, PFS_CONTACT_GAUSS_SEIDEL,  4, 0.0f, 1.5f, false, true,  1e-4, 1e-4 },
+        { "energy, swept, gauss-seidel",            PFS_SOLVER_TIME_STEPPED, PFS_CONTACT_GAUSS_SEIDEL,  4, 0.0f, 1.5f, true,  false, 1e-3, 1e-3 },
+        { "energy, swept, gauss-seidel, 64, walls", PFS_SOLVER_TIME_STEPPED, PFS_CONTACT_GAUSS_SEIDEL, 64, 0.8f, 1.5f, true,  true,  1e-3, 1e-3 },
+        { "energy, gauss-seidel, 4",                PFS_SOLVER_TIME_STEPPED, PFS_CONTACT_GAUSS_SEIDEL,  4, 0.0f, 1.5f, false, false, 1e-3, 1e-3 },
+        { "energy, gauss-seidel, 16, warm start",   PFS_SOLVER_TIME_STEPPED, PFS_CONTACT_GAUSS_SEIDEL, 16, 0.8f, 1.5f, false, false, 1e-3, 1e-3 },
+        { "energy, gauss-seidel, 64, walls",        PFS_SOLVER_TIME_STEPPED, PFS_CONTACT_GAUSS_SEIDEL, 64, 0.8f, 1.5f, false, true,  1e-3, 1e-3 },
+        { "energy, jacobi, 16, warm start",         PFS_SOLVER_TIME_STEPPED, PFS_CONTACT_JACOBI,       16, 0.8f, 1.5f, false, false, 1e-3, 1e-3 },
+        { "energy, jacobi, 64, walls",              PFS_SOLVER_TIME_STEPPED, PFS_CONTACT_JACOBI,       64, 0.8f, 1.5f, false, true,  1e-3, 1e-3 },
+        { "energy, jammed, gauss-seidel, 4",        PFS_SOLVER_TIME_STEPPED, PFS_CONTACT_GAUSS_SEIDEL,  4, 0.8f, 0.8f, false, false, 1.0,  1e-3 },
+        { "energy, jammed, gauss-seidel, 64",       PFS_SOLVER_TIME_STEPPED, PFS_CONTACT_GAUSS_SEIDEL, 64, 0.8f, 0.8f, false, false, 1.0,  1e-3 },
+        { "energy, jammed, jacobi, 16",             PFS_SOLVER_TIME_STEPPED, PFS_CONTACT_JACOBI,       16, 0.8f, 0.8f, false, false, 1.0,  1e-3 },
+        { "energy, jammed, swept, jacobi, 64",      PFS_SOLVER_TIME_STEPPED, PFS_CONTACT_JACOBI,       64, 0.8f, 0.8f, true,  false, 1.0,  1e-3 },
+        { "energy, compact",                        PFS_SOLVER_COMPACT,      PFS_CONTACT_GAUSS_SEIDEL,  4, 0.0f, 1.5f, false, false, 1e-3, 1e-3 },
+        { "energy, compact, walls",                 PFS_SOLVER_COMPACT,      PFS_CONTACT_GAUSS_SEIDEL,  4, 0.0f, 1.5f, false, true,  1e-3, 1e-3 },
+        { "energy, jammed, compact",                PFS_SOLVER_COMPACT,      PFS_CONTACT_GAUSS_SEIDEL,  4, 0.0f, 0.8f, false, false, 1.0,  1e-3 },
+    };
+
+    for (size_t i=0; i < sizeof(energy_cases) / sizeof(energy_cases[0]); i++)
+        test_energy(&energy_cases[i]);
+    test_events_gravity();
+    test_broadphase();
+    test_compact_round_trip();
+    test_compact_gravity();
+    test_compact_rescale();
+    test_tunnelling();
+    test_long_sweep();
+    test_sources();
+
+    if (failures > 0)
+    {
+        fprintf(stderr, "ERROR: %d checks failed\n", failures);
+        exit(EXIT_FAILURE);
+    }
+
+    return 0;
+}